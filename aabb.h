@@ -9,17 +9,11 @@ public:
 
   aabb(const point3 &a, const point3 &b)
   {
-    x.min = a.x();
-    x.max = b.x();
-    if(x.min > x.max) std::swap(x.min, x.max);
-
-    y.min = a.y();
-    y.max = b.y();
-    if(y.min > y.max) std::swap(y.min, y.max);
-
-    z.min = a.z();
-    z.max = b.z();
-    if(z.min > z.max) std::swap(z.min, z.max);
+    auto lo = min(a, b);
+    auto hi = max(a, b);
+    x = interval(lo.x(), hi.x());
+    y = interval(lo.y(), hi.y());
+    z = interval(lo.z(), hi.z());
   }
 
   aabb() {}
@@ -71,7 +65,7 @@ public:
   aabb pad()
   {
       // Return an AABB that has no side narrower than some delta, padding if necessary.
-        double delta = 0.0001;
+        real delta = 0.0001;
         interval new_x = (x.size() >= delta) ? x : x.expand(delta);
         interval new_y = (y.size() >= delta) ? y : y.expand(delta);
         interval new_z = (z.size() >= delta) ? z : z.expand(delta);
@@ -90,8 +84,9 @@ public:
   }
 
   bool hit(const ray& r, interval ray_t) const {
+    auto inv_dir = reciprocal(r.direction());
     for (int a = 0; a < 3; a++) {
-        auto invD = 1 / r.direction()[a];
+        auto invD = inv_dir[a];
         auto orig = r.origin()[a];
 
         auto t0 = (axis(a).min - orig) * invD;
@@ -0,0 +1,350 @@
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "constant_medium.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "perlin.h"
+#include "quad.h"
+#include "ray_packet.h"
+#include "sphere.h"
+#include "triangle.h"
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Microbenchmarks for the intersection and texture kernels, in the style of Google
+// Benchmark: each case is a function that loops `for (auto _ : state)` over a fixed set
+// of random rays, and the harness grows the iteration count until the loop runs long
+// enough to time. Results are ns per call and calls per second; every call of the hit
+// kernels traces one ray, so for them the latter is rays per second.
+
+class bench_state {
+  // Only the `for (auto _ : state)` loop is timed; setup before it is not.
+  public:
+    explicit bench_state(uint64_t iterations) : iterations(iterations) {}
+
+    class iterator {
+      public:
+        iterator(bench_state* state, uint64_t left) : state(state), left(left) {}
+
+        bool operator!=(const iterator&) const {
+            if (left != 0) return true;
+            state->stop = std::chrono::steady_clock::now();
+            return false;
+        }
+
+        void operator++() { --left; }
+        int operator*() const { return 0; }
+
+      private:
+        bench_state* state;
+        uint64_t left;
+    };
+
+    iterator begin() {
+        start = std::chrono::steady_clock::now();
+        return iterator(this, iterations);
+    }
+    iterator end() { return iterator(this, 0); }
+
+    double seconds() const { return std::chrono::duration<double>(stop - start).count(); }
+
+    uint64_t iterations;
+
+  private:
+    std::chrono::steady_clock::time_point start, stop;
+};
+
+// Keeps the compiler from discarding a result it can prove is otherwise unused.
+template <typename T>
+inline void do_not_optimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class benchmark {
+  public:
+    std::string name;
+    std::function<void(bench_state&)> run;
+};
+
+static std::vector<benchmark>& registry() {
+    static std::vector<benchmark> benchmarks;
+    return benchmarks;
+}
+
+static bool register_benchmark(const char* name, void (*fn)(bench_state&)) {
+    registry().push_back({name, fn});
+    return true;
+}
+
+#define BENCHMARK(fn) static bool fn##_registered = register_benchmark(#fn, fn)
+
+// Fixed ray set: origins on a sphere of radius 4 around the unit cube, aimed at random
+// points in a box a little larger than it, so roughly half the rays hit each target.
+static const std::vector<ray>& rays() {
+    static const std::vector<ray> set = [] {
+        pcg32 gen(2024);
+        auto u = [&] { return gen.next() / 4294967296.0; };
+        std::vector<ray> r;
+        for (int i = 0; i < 4096; ++i) {
+            auto origin = 4 * sample_unit_vector(u(), u());
+            auto target = point3(3 * u() - 1.5, 3 * u() - 1.5, 3 * u() - 1.5);
+            r.emplace_back(origin, target - origin);
+        }
+        return r;
+    }();
+    return set;
+}
+
+static void run_hit_bench(bench_state& state, const hittable& object) {
+    const auto& r = rays();
+    size_t k = 0;
+    for ([[maybe_unused]] auto _ : state) {
+        hit_record rec;
+        bool hit = object.hit(r[k], interval(0.001, infinity), rec);
+        do_not_optimize(hit);
+        k = (k + 1) & (r.size() - 1);
+    }
+}
+
+static std::shared_ptr<material> bench_material() {
+    static auto mat = std::make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    return mat;
+}
+
+static void aabb_hit(bench_state& state) {
+    aabb box(point3(-1, -1, -1), point3(1, 1, 1));
+    const auto& r = rays();
+    size_t k = 0;
+    for ([[maybe_unused]] auto _ : state) {
+        bool hit = box.hit(r[k], interval(0.001, infinity));
+        do_not_optimize(hit);
+        k = (k + 1) & (r.size() - 1);
+    }
+}
+BENCHMARK(aabb_hit);
+
+static void sphere_hit(bench_state& state) {
+    sphere s(point3(0, 0, 0), 1, bench_material());
+    run_hit_bench(state, s);
+}
+BENCHMARK(sphere_hit);
+
+static void quad_hit(bench_state& state) {
+    quad q(point3(-1, -1, 0), vec3(2, 0, 0), vec3(0, 2, 0), bench_material());
+    run_hit_bench(state, q);
+}
+BENCHMARK(quad_hit);
+
+static void triangle_hit(bench_state& state) {
+    triangle t(point3(-1, -1, 0), point3(1, -1, 0), point3(-1, 1, 0), bench_material());
+    run_hit_bench(state, t);
+}
+BENCHMARK(triangle_hit);
+
+static void box_hit(bench_state& state) {
+    auto b = box(point3(-1, -1, -1), point3(1, 1, 1), bench_material());
+    run_hit_bench(state, *b);
+}
+BENCHMARK(box_hit);
+
+static void rotate_y_hit(bench_state& state) {
+    rotate_y r(box(point3(-1, -1, -1), point3(1, 1, 1), bench_material()), 0.5);
+    run_hit_bench(state, r);
+}
+BENCHMARK(rotate_y_hit);
+
+// The same rotated box as one instance in a BVH leaf.
+static void bvh_instance_hit(bench_state& state) {
+    bvh_node bvh(hittable_list(std::make_shared<rotate_y>(
+        box(point3(-1, -1, -1), point3(1, 1, 1), bench_material()), 0.5)));
+    run_hit_bench(state, bvh);
+}
+BENCHMARK(bvh_instance_hit);
+
+static void constant_medium_hit(bench_state& state) {
+    auto boundary = std::make_shared<sphere>(point3(0, 0, 0), 1, bench_material());
+    constant_medium m(boundary, 0.5, color(1, 1, 1));
+    run_hit_bench(state, m);
+}
+BENCHMARK(constant_medium_hit);
+
+static bvh_node bench_bvh() {
+    // 1000 small spheres in the cube, about the size of the final scene's ground clutter.
+    pcg32 gen(7);
+    auto u = [&] { return gen.next() / 4294967296.0; };
+    hittable_list spheres;
+    for (int i = 0; i < 1000; ++i)
+        spheres.add(std::make_shared<sphere>(point3(2 * u() - 1, 2 * u() - 1, 2 * u() - 1),
+                                             0.05, bench_material()));
+    return bvh_node(spheres);
+}
+
+static void bvh_node_hit(bench_state& state) {
+    auto bvh = bench_bvh();
+    run_hit_bench(state, bvh);
+}
+BENCHMARK(bvh_node_hit);
+
+// Coherent camera rays: packets of ray_packet::size rays from one eye point through a
+// small patch of a view of the cube, as primary rays of one pixel's samples are. The
+// single ray case traces the same rays one at a time; both count per ray.
+static const std::vector<ray_packet>& coherent_packets() {
+    static const std::vector<ray_packet> set = [] {
+        pcg32 gen(99);
+        auto u = [&] { return gen.next() / 4294967296.0; };
+        std::vector<ray_packet> packets(512);
+        for (auto& p : packets) {
+            auto target = point3(2.4 * u() - 1.2, 2.4 * u() - 1.2, 0);
+            for (int k = 0; k < ray_packet::size; ++k)
+                p.add(ray(point3(0, 0, 4), target + vec3(0.01 * u(), 0.01 * u(), 0) - point3(0, 0, 4)));
+            p.finish();
+        }
+        return packets;
+    }();
+    return set;
+}
+
+static void bvh_coherent_single(bench_state& state) {
+    auto bvh = bench_bvh();
+    const auto& packets = coherent_packets();
+    size_t k = 0;
+    for ([[maybe_unused]] auto _ : state) {
+        const auto& p = packets[k / ray_packet::size];
+        hit_record rec;
+        bool hit = bvh.hit(p.get(int(k % ray_packet::size)), interval(0.001, infinity), rec);
+        do_not_optimize(hit);
+        k = (k + 1) % (packets.size() * ray_packet::size);
+    }
+}
+BENCHMARK(bvh_coherent_single);
+
+static void bvh_coherent_packet(bench_state& state) {
+    // One packet per ray_packet::size iterations, so ns/call is still per ray.
+    auto bvh = bench_bvh();
+    const auto& packets = coherent_packets();
+    state.iterations = std::max<uint64_t>(1, state.iterations / ray_packet::size);
+    size_t k = 0;
+    for ([[maybe_unused]] auto _ : state) {
+        packet_hits hits;
+        bvh.hit_packet(packets[k], hits, ray_packet::all);
+        do_not_optimize(hits.mask);
+        k = (k + 1) % packets.size();
+    }
+}
+BENCHMARK(bvh_coherent_packet);
+
+// The vec3 kernels themselves, chained through the ray set so each call depends on data
+// the compiler cannot fold.
+static void vec3_dot(bench_state& state) {
+    const auto& r = rays();
+    size_t k = 0;
+    for ([[maybe_unused]] auto _ : state) {
+        auto d = dot(r[k].origin(), r[k].direction());
+        do_not_optimize(d);
+        k = (k + 1) & (r.size() - 1);
+    }
+}
+BENCHMARK(vec3_dot);
+
+static void vec3_cross(bench_state& state) {
+    const auto& r = rays();
+    size_t k = 0;
+    for ([[maybe_unused]] auto _ : state) {
+        auto c = cross(r[k].origin(), r[k].direction());
+        do_not_optimize(c);
+        k = (k + 1) & (r.size() - 1);
+    }
+}
+BENCHMARK(vec3_cross);
+
+static void vec3_unit_vector(bench_state& state) {
+    const auto& r = rays();
+    size_t k = 0;
+    for ([[maybe_unused]] auto _ : state) {
+        auto u = unit_vector(r[k].direction());
+        do_not_optimize(u);
+        k = (k + 1) & (r.size() - 1);
+    }
+}
+BENCHMARK(vec3_unit_vector);
+
+static void vec3_slab(bench_state& state) {
+    // The min/max/reciprocal form of a box slab test, without the early exits.
+    const point3 lo(-1, -1, -1), hi(1, 1, 1);
+    const auto& r = rays();
+    size_t k = 0;
+    for ([[maybe_unused]] auto _ : state) {
+        auto inv = reciprocal(r[k].direction());
+        auto t0 = (lo - r[k].origin()) * inv;
+        auto t1 = (hi - r[k].origin()) * inv;
+        auto near = min(t0, t1), far = max(t0, t1);
+        do_not_optimize(near);
+        do_not_optimize(far);
+        k = (k + 1) & (r.size() - 1);
+    }
+}
+BENCHMARK(vec3_slab);
+
+static void perlin_turb(bench_state& state) {
+    perlin noise;
+    const auto& r = rays();
+    size_t k = 0;
+    for ([[maybe_unused]] auto _ : state) {
+        auto t = noise.turb(r[k].origin(), 7);
+        do_not_optimize(t);
+        k = (k + 1) & (r.size() - 1);
+    }
+}
+BENCHMARK(perlin_turb);
+
+int main(int argc, char** argv) {
+    double min_time = 0.5;
+    std::string filter;
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--min-time") && i + 1 < argc)
+            min_time = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--filter") && i + 1 < argc)
+            filter = argv[++i];
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--min-time seconds] [--filter substring]\n";
+            return 1;
+        }
+    }
+
+    std::cout << std::left << std::setw(24) << "benchmark" << std::right
+              << std::setw(14) << "iterations" << std::setw(12) << "ns/call"
+              << std::setw(14) << "Mcalls/s" << '\n';
+
+    rays();
+    for (const auto& b : registry()) {
+        if (!filter.empty() && b.name.find(filter) == std::string::npos)
+            continue;
+
+        // Grow the iteration count until one run takes at least min_time.
+        uint64_t iterations = 1;
+        double seconds = 0;
+        while (true) {
+            bench_state state(iterations);
+            b.run(state);
+            seconds = state.seconds();
+            if (seconds >= min_time || iterations >= (uint64_t(1) << 40))
+                break;
+            iterations *= seconds > 0.01 ? std::max<uint64_t>(2, uint64_t(1.2 * min_time / seconds))
+                                         : 10;
+        }
+
+        auto ns = seconds * 1e9 / iterations;
+        std::cout << std::left << std::setw(24) << b.name << std::right
+                  << std::setw(14) << iterations << std::fixed << std::setprecision(2)
+                  << std::setw(12) << ns << std::setw(14) << 1e3 / ns << '\n';
+    }
+}
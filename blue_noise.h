@@ -0,0 +1,108 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+class blue_noise_tile {
+  // A tileable square of values in [0,1) whose differences between neighbors are mostly
+  // high frequency, made with Ulichney's void-and-cluster method: points are ranked by
+  // repeatedly filling the largest void of a Gaussian-filtered binary pattern on a torus.
+  // Built once, on first use, from a fixed seed.
+  public:
+    static constexpr int size = 64;
+
+    static const blue_noise_tile& get() {
+        static const blue_noise_tile tile;
+        return tile;
+    }
+
+    // Value at (x, y), wrapped to the tile.
+    double operator()(int x, int y) const {
+        return values[size_t(y & (size - 1)) * size + (x & (size - 1))];
+    }
+
+  private:
+    static constexpr int count = size * size;
+    std::vector<double> values;
+
+    blue_noise_tile() : values(count) {
+        // Toroidal Gaussian kernel, sigma 1.5, indexed by the wrapped offset.
+        std::vector<double> kernel(count);
+        for (int dy = 0; dy < size; ++dy)
+            for (int dx = 0; dx < size; ++dx) {
+                auto x = std::min(dx, size - dx), y = std::min(dy, size - dy);
+                kernel[dy * size + dx] = std::exp(-(x * x + y * y) / (2 * 1.5 * 1.5));
+            }
+
+        std::vector<char> on(count, 0);
+        std::vector<double> energy(count, 0.0);
+        auto splat = [&](int p, double sign) {
+            int px = p % size, py = p / size;
+            for (int y = 0; y < size; ++y)
+                for (int x = 0; x < size; ++x)
+                    energy[y * size + x] +=
+                        sign * kernel[((y - py) & (size - 1)) * size + ((x - px) & (size - 1))];
+        };
+        auto tightest_cluster = [&] {
+            int best = -1;
+            for (int p = 0; p < count; ++p)
+                if (on[p] && (best < 0 || energy[p] > energy[best])) best = p;
+            return best;
+        };
+        auto largest_void = [&] {
+            int best = -1;
+            for (int p = 0; p < count; ++p)
+                if (!on[p] && (best < 0 || energy[p] < energy[best])) best = p;
+            return best;
+        };
+
+        // Initial pattern: a tenth of the cells at random, then relaxed by moving the
+        // tightest cluster into the largest void until that move is a no-op.
+        pcg32 gen(0x626c7565);
+        int initial = 0;
+        while (initial < count / 10) {
+            int p = int(gen.next() % count);
+            if (on[p]) continue;
+            on[p] = 1;
+            splat(p, 1);
+            ++initial;
+        }
+        while (true) {
+            int c = tightest_cluster();
+            on[c] = 0;
+            splat(c, -1);
+            int v = largest_void();
+            on[v] = 1;
+            splat(v, 1);
+            if (v == c) break;
+        }
+        auto prototype = on;
+        auto prototype_energy = energy;
+
+        // Rank the initial points by removing the tightest cluster each time...
+        std::vector<int> rank(count);
+        for (int r = initial - 1; r >= 0; --r) {
+            int c = tightest_cluster();
+            on[c] = 0;
+            splat(c, -1);
+            rank[c] = r;
+        }
+
+        // ...and the rest by filling the largest void, which for the remaining zeros is
+        // also their tightest cluster.
+        on = prototype;
+        energy = prototype_energy;
+        for (int r = initial; r < count; ++r) {
+            int v = largest_void();
+            on[v] = 1;
+            splat(v, 1);
+            rank[v] = r;
+        }
+
+        for (int p = 0; p < count; ++p)
+            values[p] = (rank[p] + 0.5) / count;
+    }
+};
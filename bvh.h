@@ -84,78 +84,217 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "instrument.h"
+#include "primitive.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <typeinfo>
+#include <vector>
 
 
+// The scene's primitives flattened into one array, in leaf order, with the nodes in
+// another (depth first, so a node's left child follows it). Leaves hold one or two
+// primitives by value; see primitive for the closed set and its fallback.
 class bvh_node : public hittable {
   public:
     bvh_node(const hittable_list& list) : bvh_node(list.objects, 0, list.objects.size()) {}
 
     bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end) {
-        auto objects = src_objects; // Create a modifiable array of the source scene objects
+        for (size_t i = start; i < end; ++i)
+            add_primitives(src_objects[i], primitives);
+        if (!primitives.empty())
+            build(0, primitives.size());
+        bbox = nodes.empty() ? aabb() : nodes[0].bbox;
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        surface_hit closest;
+        if (nodes.empty() || !hit_node(0, r, ray_t, closest, rec))
+            return false;
+        if (closest.deferred)
+            closest.prim->complete(r, closest, rec);
+        return true;
+    }
+
+    void hit_packet(const ray_packet& rays, packet_hits& hits, unsigned mask) const override {
+        if (nodes.empty())
+            return;
+        hit_packet_node(0, rays, hits, mask);
+
+        for (int k = 0; k < ray_packet::size; ++k) {
+            auto& pending = hits.pending[k];
+            if (pending.deferred && !hits.owner[k]) {
+                pending.prim->complete(rays.get(k), pending, hits.rec[k]);
+                pending.deferred = false;
+            }
+        }
+    }
 
+    aabb bounding_box() const override { return bbox; }
+
+  private:
+    class node {
+      public:
+        aabb bbox;
+        uint32_t first = 0; // Leaf: first primitive. Inner node: right child.
+        uint32_t count = 0; // Leaf: number of primitives. Inner node: 0.
+    };
+
+    std::vector<node> nodes;
+    std::vector<primitive> primitives;
+    aabb bbox;
+
+    // Instances with more children than this get a tree of their own.
+    static constexpr size_t max_instance_children = 4;
+
+    // Builds the subtree over primitives[start, end) and returns its root: the splits
+    // of the pointer based tree this replaced, down to leaves of one or two.
+    uint32_t build(size_t start, size_t end) {
         int axis = random_int(0,2);
-        auto comparator = (axis == 0) ? box_x_compare
-                        : (axis == 1) ? box_y_compare
-                                      : box_z_compare;
+        auto comparator = [axis](const primitive& a, const primitive& b) {
+            return a.bounding_box().axis(axis).min < b.bounding_box().axis(axis).min;
+        };
 
+        auto index = uint32_t(nodes.size());
+        nodes.emplace_back();
         size_t object_span = end - start;
 
-        if (object_span == 1) {
-            left = right = objects[start];
-        } else if (object_span == 2) {
-            if (comparator(objects[start], objects[start+1])) {
-                left = objects[start];
-                right = objects[start+1];
-            } else {
-                left = objects[start+1];
-                right = objects[start];
-            }
+        if (object_span <= 2) {
+            if (object_span == 2 && !comparator(primitives[start], primitives[start+1]))
+                std::swap(primitives[start], primitives[start+1]);
+            nodes[index].first = uint32_t(start);
+            nodes[index].count = uint32_t(object_span);
+            nodes[index].bbox = aabb(primitives[start].bounding_box(),
+                                     primitives[end-1].bounding_box());
         } else {
-            std::sort(objects.begin() + start, objects.begin() + end, comparator);
+            std::sort(primitives.begin() + start, primitives.begin() + end, comparator);
 
             auto mid = start + object_span/2;
-            left = make_shared<bvh_node>(objects, start, mid);
-            right = make_shared<bvh_node>(objects, mid, end);
+            build(start, mid);
+            auto right = build(mid, end);
+            nodes[index].first = right;
+            nodes[index].bbox = aabb(nodes[index+1].bbox, nodes[right].bbox);
         }
-
-        bbox = aabb(left->bounding_box(), right->bounding_box());
+        return index;
     }
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        if (!bbox.hit(r, ray_t))
-            return false;
-
-        bool hit_left = left->hit(r, ray_t, rec);
-        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
-
-        return hit_left || hit_right;
+    // Closest hit in the subtree at n, visiting children left first as the recursive
+    // tree did, with the interval shrinking to each hit found. Only objects outside the
+    // closed set write rec; see primitive::intersect().
+    bool hit_node(uint32_t n, const ray& r, interval ray_t, surface_hit& closest,
+                  hit_record& rec) const {
+        uint32_t stack[64];
+        int top = 0;
+        bool hit_anything = false;
+        while (true) {
+            RT_COUNT(node_visits);
+            const auto& nd = nodes[n];
+            if (nd.bbox.hit(r, ray_t)) {
+                if (nd.count == 0) {
+                    stack[top++] = nd.first;
+                    n = n + 1;
+                    continue;
+                }
+                for (auto p = nd.first; p < nd.first + nd.count; ++p) {
+                    if (primitives[p].intersect(r, ray_t, closest, rec)) {
+                        hit_anything = true;
+                        ray_t.max = closest.t;
+                    }
+                }
+            }
+            if (top == 0)
+                return hit_anything;
+            n = stack[--top];
+        }
     }
 
-    aabb bounding_box() const override { return bbox; }
+    void hit_packet_node(uint32_t n, const ray_packet& rays, packet_hits& hits, unsigned mask) const {
+        // A packet down to one ray has diverged; the rest of the subtree is traced alone.
+        if ((mask & (mask - 1)) == 0) {
+            if (!mask)
+                return;
+            auto k = __builtin_ctz(mask);
+            surface_hit closest;
+            hit_record rec;
+            if (!hit_node(n, rays.get(k), interval(rays.t_min, hits.t[k]), closest, rec))
+                return;
+            if (closest.deferred)
+                hits.defer(k, closest);
+            else
+                hits.set(k, rec);
+            return;
+        }
 
-  private:
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
-    aabb bbox;
+        RT_COUNT_N(node_visits, __builtin_popcount(mask));
+        const auto& nd = nodes[n];
+        mask = packet_box_hit(nd.bbox, rays, hits.t, mask);
+        if (!mask)
+            return;
 
-    static bool box_compare(
-        const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index
-    ) {
-        return a->bounding_box().axis(axis_index).min < b->bounding_box().axis(axis_index).min;
+        if (nd.count > 0) {
+            for (auto p = nd.first; p < nd.first + nd.count; ++p)
+                primitives[p].hit_packet(rays, hits, mask);
+            return;
+        }
+
+        hit_packet_node(n + 1, rays, hits, mask);
+        hit_packet_node(nd.first, rays, hits, mask);
     }
 
-    static bool box_x_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 0);
+    // object as an exact T, or null. Exact so a subclass is never copied as its base.
+    template <typename T>
+    static const T* exactly(const shared_ptr<hittable>& object) {
+        return typeid(*object) == typeid(T) ? static_cast<const T*>(object.get()) : nullptr;
     }
 
-    static bool box_y_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 1);
+    // Appends object to out as primitives: lists are flattened into their members,
+    // chains of translate and rotate_y become one instance, and objects outside the
+    // closed set are kept as they are.
+    static void add_primitives(const shared_ptr<hittable>& object, std::vector<primitive>& out) {
+        if (auto list = exactly<hittable_list>(object)) {
+            for (const auto& member : list->objects)
+                add_primitives(member, out);
+        } else if (auto s = exactly<sphere>(object)) {
+            out.emplace_back(*s, object);
+        } else if (auto q = exactly<quad>(object)) {
+            out.emplace_back(*q, object);
+        } else if (auto c = exactly<cuboid>(object)) {
+            out.emplace_back(*c, object);
+        } else if (auto t = exactly<triangle>(object)) {
+            out.emplace_back(*t, object);
+        } else if (exactly<translate>(object) || exactly<rotate_y>(object)) {
+            out.emplace_back(make_instance(object), object);
+        } else {
+            out.emplace_back(object, object);
+        }
     }
 
-    static bool box_z_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 2);
+    static instance make_instance(const shared_ptr<hittable>& object) {
+        instance inst;
+        inst.bbox = object->bounding_box();
+
+        auto inner = object;
+        while (true) {
+            if (auto t = exactly<translate>(inner)) {
+                inst.translate_by(t->offset);
+                inner = t->object;
+            } else if (auto r = exactly<rotate_y>(inner)) {
+                inst.rotate_by(r->sin_theta, r->cos_theta);
+                inner = r->ptr;
+            } else {
+                break;
+            }
+        }
+
+        std::vector<primitive> children;
+        add_primitives(inner, children);
+        if (children.size() > max_instance_children) {
+            children.clear();
+            children.emplace_back(make_shared<bvh_node>(hittable_list(inner)), inner);
+        }
+        inst.children = make_shared<const std::vector<primitive>>(std::move(children));
+        return inst;
     }
 };
 
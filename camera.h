@@ -1,14 +1,38 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <fstream>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "color.h"
+#include "denoiser.h"
+#include "exr_writer.h"
+#include "framebuffer.h"
+#include "image_writer.h"
 #include "hittable.h"
+#include "instrument.h"
 #include "interval.h"
 #include "pdf.h"
+#include "perf_counters.h"
 #include "ray.h"
+#include "ray_packet.h"
 #include "rtweekend.h"
+#include "sampler.h"
+#include "wavefront.h"
+
+// Counters from the last camera::render(), for benchmarks.
+class render_stats {
+public:
+  unsigned long long primary_rays = 0; // Camera rays, one per pixel sample
+  unsigned long long rays = 0;         // All rays traced, primary rays included
+  double seconds = 0;                  // Wall time of render(), output included
+  ray_counters counters;               // Only counted in RT_INSTRUMENT builds
+  std::vector<perf::phase_total> perf; // Hardware counts per phase, with perf::enable()
+};
 
 class camera {
 public:
@@ -26,41 +50,153 @@ public:
   double shutter_time{0};
   color background{0, 0, 0};
 
+  // Source of the numbers for pixel jitter, lens, time and BSDF sampling. Swap in a
+  // sobol_sampler for Owen-scrambled Sobol points.
+  std::shared_ptr<sampler> pixel_sampler = std::make_shared<independent_sampler>();
+
+  // Output file; the extension picks binary PPM (.ppm), float PFM (.pfm) or 16 bit
+  // PNG (.png). Images are encoded and written on a background thread.
+  std::string output_path = "output/image.ppm";
+
+  // When set, a tiled float EXR with linear beauty, albedo, normal, depth and sample
+  // count channels is also written. The AOVs are gathered in the same samples.
+  std::string aov_path;
+
+  // Edge-aware denoising of the finished render, guided by the AOVs (which it
+  // enables). The denoised image goes to output_path, the raw one to <name>_noisy.
+  bool denoise = false;
+  denoiser denoise_filter;
+
+  // Firefly suppression. radiance_clamp[k] caps the largest channel of the radiance
+  // carried by path vertex k (0 is the primary hit) by scaling it down; the last entry
+  // also covers deeper vertices and values <= 0 disable it. E.g. {0, 10} leaves directly
+  // visible lights alone and clamps all indirect light at 10. With mom_buckets > 1 each
+  // pixel keeps that many sample buckets and reports the median of their means.
+  std::vector<double> radiance_clamp;
+  int mom_buckets = 0;
+
+  // Streaming mode for images larger than memory: when stream_path is set, the image
+  // is rendered tile by tile and each finished tile is appended to a tiled float EXR at
+  // that path and dropped. At most max_inflight_tiles finished tiles wait for the disk,
+  // so memory does not grow with the image size. AOVs are included when aov_path is
+  // set. This mode renders samples_per_pixel in one go and writes no other images.
+  std::string stream_path;
+  int tile_size = 64;
+  int max_inflight_tiles = 2;
+
+  // Adaptive sampling: samples_per_pixel becomes the average budget per pixel, spent
+  // first on adaptive_min_samples everywhere and then on pixels whose relative standard
+  // error is still above adaptive_threshold.
+  bool adaptive = false;
+  int adaptive_min_samples = 16;
+  int adaptive_max_samples = 0; // Per pixel cap, 0 means 16 * samples_per_pixel
+  double adaptive_threshold = 0.02;
+
+  // Progressive mode: with time_budget > 0 (seconds), render passes of pass_samples
+  // samples per pixel until the deadline, rewriting the image after each pass.
+  double time_budget = 0;
+  int pass_samples = 4;
+
+  // Checkpointing: every checkpoint_interval seconds (0 disables) the accumulation
+  // buffer, sample counts and RNG state are written to checkpoint_path. With resume set,
+  // render() continues from that file and produces the same image as an uninterrupted run.
+  std::string checkpoint_path = "output/render.ckpt";
+  double checkpoint_interval = 0;
+  bool resume = false;
+
+  // Ray packets: the primary rays of each pixel's samples are traced together,
+  // ray_packet::size at a time, through the packet BVH traversal. Later bounces scatter
+  // too widely to share traversal and are traced one ray at a time.
+  bool ray_packets = true;
+
+  // Wavefront integrator for the plain (not adaptive, progressive or streamed) render:
+  // the paths of whole scanlines, up to wavefront_paths of them, advance together one
+  // bounce at a time through generate, intersect, shade and sort stages, instead of
+  // each sample recursing on its own. Between stages the paths are sorted by material
+  // before shading and by direction before intersection. The path state takes a few
+  // hundred bytes per path, so batches are kept small enough to stay in cache.
+  // In the other modes, and with radiance_clamp, the recursive integrator runs instead.
+  bool wavefront = false;
+  int wavefront_paths = 1 << 13;
+
+  const render_stats &stats() const { return last_stats; }
+
   void lookat(const point3 &pt, const vec3 &_up) {
     look_dir = unit_vector(pt - center);
     up = unit_vector(_up - look_dir * dot(look_dir, _up));
   }
+
   void render(const hittable &world, const hittable * lights) {
     initialize();
-    std::ofstream ofs("output/image.ppm");
-    ofs << "P3\n" << image_width << " " << image_height << "\n255\n";
-    for (int j = 0; j < image_height; ++j) {
-      std::clog << "\rScanlines remaining: " << (image_height - j) << ' '
-                << std::flush;
-      for (int i = 0; i < image_width; ++i) {
-
-        color pixel_color(0, 0, 0);
-        for (auto sample = 0; sample < samples_per_pixel; ++sample) {
-          auto ru = random_double();
-          auto rv = random_double();
-          auto pixel_center = pixel00_loc + (i + ru - 0.5) * pixel_delta_u +
-                              (j - 0.5 + rv) * pixel_delta_v;
+    if (!stream_path.empty()) {
+      render_streaming(world, lights);
+      return;
+    }
+    framebuffer fb(image_width, image_height);
+    if (!aov_path.empty() || denoise)
+      fb.enable_aovs();
+    if (mom_buckets > 1)
+      fb.enable_buckets(mom_buckets);
+    writer = std::make_unique<async_image_writer>();
+    rays_traced = 0;
+    primary_rays = 0;
+    if (instrument::enabled)
+      pixel_cost.assign(size_t(image_width) * image_height, 0.0);
+    auto start = std::chrono::steady_clock::now();
+    last_checkpoint = start;
 
-          auto ray_origin =
-              (defocus_angle <= 0) ? center : defocus_disk_sample();
-          auto ray_direction = pixel_center - ray_origin;
+    {
+      perf::phase render_phase("render");
 
-          double delta_time = random_double() * shutter_time;
-          ray r(ray_origin, ray_direction, delta_time);
+      // Completed scanlines, or completed passes in the adaptive and progressive modes.
+      int progress = resume ? load_checkpoint(fb) : 0;
 
-          pixel_color += ray_color(r, max_depth, world, lights);
+      if (time_budget > 0) {
+        render_progressive(fb, world, lights, progress);
+      } else if (wavefront && !adaptive && radiance_clamp.empty()) {
+        render_wavefront(fb, world, lights, progress);
+      } else if (adaptive) {
+        render_adaptive(fb, world, lights, progress);
+        write_heatmap(output_sibling("samples"), fb.width(), fb.height(),
+                      [&](int i, int j) { return double(fb.samples(i, j)); },
+                      "Sample counts");
+      } else {
+        for (int j = progress; j < image_height; ++j) {
+          std::clog << "\rScanlines remaining: " << (image_height - j) << ' '
+                    << std::flush;
+          for (int i = 0; i < image_width; ++i)
+            add_samples(fb, i, j, samples_per_pixel, world, lights);
+          checkpoint(fb, j + 1);
         }
+      }
+    }
 
-        write_color(ofs, pixel_color, samples_per_pixel);
+    {
+      perf::phase output_phase("output");
+      if (denoise) {
+        write_image(output_sibling("noisy"), fb);
+        auto t0 = std::chrono::steady_clock::now();
+        auto denoised = denoise_filter.denoise(fb);
+        std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+        std::clog << "\rDenoised in " << dt.count() * 1000 << "ms\n";
+        writer->submit(output_path, std::move(denoised));
+      } else {
+        write_image(output_path, fb);
       }
+      if (!aov_path.empty())
+        write_aovs(aov_path, fb);
+      if (instrument::enabled)
+        write_heatmap(output_sibling("cost"), image_width, image_height,
+                      [&](int i, int j) { return pixel_cost[size_t(j) * image_width + i]; },
+                      "Traversal cost (nodes + primitive tests)");
+      writer.reset(); // Waits for pending writes
     }
-    ofs.close();
-    std::clog << "\rDone.                 \n";
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    record_stats(elapsed.count());
+    std::clog << "\rDone.                 \n"
+              << "Rays traced: " << rays_traced << ", "
+              << rays_traced / elapsed.count() << " rays/s\n";
   }
 
 private:
@@ -76,6 +212,13 @@ private:
   vec3 pixel_delta_u; // Offset to pixel to the right
   vec3 pixel_delta_v; // Offset to pixel below
 
+  mutable unsigned long long rays_traced = 0;
+  mutable unsigned long long primary_rays = 0;
+  render_stats last_stats;
+  mutable std::vector<double> pixel_cost; // Traversal work per pixel, RT_INSTRUMENT only
+  std::unique_ptr<async_image_writer> writer;
+  std::chrono::steady_clock::time_point last_checkpoint;
+
   void initialize() {
     image_height = image_width / aspect_ratio;
     image_height = (image_height < 1) ? 1 : image_height;
@@ -95,44 +238,615 @@ private:
     defocus_disk_v = -defocus_radius * up;
   }
 
-  point3 defocus_disk_sample() const {
+  // Samples pixel (i, j) into fb, whose pixel (0, 0) is image pixel (x0, y0).
+  void add_sample(framebuffer &fb, int i, int j, const hittable &world,
+                  const hittable * lights, int x0 = 0, int y0 = 0) const {
+    auto index = fb.samples(i - x0, j - y0);
+    unsigned long long work_before = 0;
+    if constexpr (instrument::enabled)
+      work_before = instrument::local.traversal_work();
+    if (fb.has_aovs()) {
+      aov_sample aov;
+      auto c = sample_pixel(i, j, index, world, lights, &aov);
+      fb.add_sample(i - x0, j - y0, c, aov);
+    } else {
+      fb.add_sample(i - x0, j - y0, sample_pixel(i, j, index, world, lights));
+    }
+    if constexpr (instrument::enabled)
+      if (!pixel_cost.empty())
+        pixel_cost[size_t(j) * image_width + i] +=
+            double(instrument::local.traversal_work() - work_before);
+  }
+
+  // Adds n samples to pixel (i, j), with their primary rays in packets when
+  // ray_packets is set.
+  void add_samples(framebuffer &fb, int i, int j, int n, const hittable &world,
+                   const hittable * lights, int x0 = 0, int y0 = 0) const {
+    if (!ray_packets || max_depth < 2) {
+      for (int s = 0; s < n; ++s)
+        add_sample(fb, i, j, world, lights, x0, y0);
+      return;
+    }
+    for (int first = 0; first < n; first += ray_packet::size)
+      add_packet(fb, i, j, std::min(n - first, ray_packet::size), world, lights, x0, y0);
+  }
+
+  // add_sample() for `count` samples at once: their camera rays are made first and
+  // intersected as one packet, then each path continues on its own from its hit.
+  void add_packet(framebuffer &fb, int i, int j, int count, const hittable &world,
+                  const hittable * lights, int x0, int y0) const {
+    auto &smp = *pixel_sampler;
+    auto first_index = fb.samples(i - x0, j - y0);
+    unsigned long long work_before = 0;
+    if constexpr (instrument::enabled)
+      work_before = instrument::local.traversal_work();
+
+    ray_packet rays;
+    for (int k = 0; k < count; ++k) {
+      smp.start_pixel_sample(i, j, first_index + k);
+      rays.add(primary_ray(smp, i, j));
+    }
+    rays.finish();
+    packet_hits hits;
+    world.hit_packet(rays, hits, rays.lanes());
+
+    for (int k = 0; k < count; ++k) {
+      smp.start_pixel_sample(i, j, first_index + k);
+      ++primary_rays;
+      ++rays_traced;
+      RT_COUNT(paths);
+      auto r = rays.get(k);
+      bool hit = hits.mask >> k & 1;
+      if (fb.has_aovs()) {
+        aov_sample aov;
+        auto c = shade(r, max_depth - 1, hit, hits.rec[k], world, lights, &aov);
+        fb.add_sample(i - x0, j - y0, clamp_radiance(c, 0), aov);
+      } else {
+        auto c = shade(r, max_depth - 1, hit, hits.rec[k], world, lights);
+        fb.add_sample(i - x0, j - y0, clamp_radiance(c, 0));
+      }
+    }
+
+    if constexpr (instrument::enabled)
+      if (!pixel_cost.empty())
+        pixel_cost[size_t(j) * image_width + i] +=
+            double(instrument::local.traversal_work() - work_before);
+  }
+
+  void render_streaming(const hittable &world, const hittable * lights) {
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    rays_traced = 0;
+    primary_rays = 0;
+    pixel_cost.clear(); // A full image of costs would defeat streaming
+
+    framebuffer layout(1, 1);
+    if (!aov_path.empty())
+      layout.enable_aovs();
+    exr_writer exr(stream_path, image_width, image_height, layout.channel_names(),
+                   tile_size, true);
+    writer = std::make_unique<async_image_writer>(std::max(max_inflight_tiles, 1));
+
+    auto tiles = exr.tiles_across() * exr.tiles_down();
+    auto render_phase = std::make_unique<perf::phase>("render");
+    for (int ty = 0; ty < exr.tiles_down(); ++ty) {
+      for (int tx = 0; tx < exr.tiles_across(); ++tx) {
+        std::clog << "\rTiles remaining: " << tiles-- << ' ' << std::flush;
+
+        auto x0 = tx * tile_size, y0 = ty * tile_size;
+        framebuffer tile(exr.tile_width(tx), exr.tile_height(ty));
+        if (layout.has_aovs())
+          tile.enable_aovs();
+        if (mom_buckets > 1)
+          tile.enable_buckets(mom_buckets);
+
+        for (int j = y0; j < y0 + tile.height(); ++j)
+          for (int i = x0; i < x0 + tile.width(); ++i)
+            add_samples(tile, i, j, samples_per_pixel, world, lights, x0, y0);
+
+        // The job owns the tile's channels; the tile buffer itself is freed here.
+        writer->submit(stream_path + "#" + std::to_string(ty) + "," + std::to_string(tx),
+                       [&exr, tx, ty, channels = tile.aov_channels()] {
+                         std::vector<const float *> planes;
+                         for (const auto &c : channels)
+                           planes.push_back(c.data.data());
+                         exr.write_tile(tx, ty, planes);
+                         return true;
+                       });
+      }
+    }
+
+    render_phase.reset();
+
+    {
+      perf::phase output_phase("output");
+      writer.reset(); // Waits for the last tiles
+      if (!exr.close())
+        std::clog << "\nFailed to write " << stream_path << "\n";
+    }
+
+    std::chrono::duration<double> elapsed = clock::now() - start;
+    record_stats(elapsed.count());
+    std::clog << "\rDone.                 \n"
+              << "Rays traced: " << rays_traced << ", "
+              << rays_traced / elapsed.count() << " rays/s\n";
+  }
+
+  color sample_pixel(int i, int j, int index, const hittable &world,
+                     const hittable * lights, aov_sample *aov = nullptr) const {
+    auto &smp = *pixel_sampler;
+    smp.start_pixel_sample(i, j, index);
+    ++primary_rays;
+    RT_COUNT(paths);
+    return clamp_radiance(ray_color(primary_ray(smp, i, j), max_depth, world, lights, aov), 0);
+  }
+
+  // Camera ray through pixel (i, j) for the sample smp has just started.
+  ray primary_ray(sampler &smp, int i, int j) const {
+    auto [ru, rv] = smp.get_2d();
+    auto pixel_center = pixel00_loc + (i + ru - 0.5) * pixel_delta_u +
+                        (j - 0.5 + rv) * pixel_delta_v;
+
+    smp.start_dimension(sample_dimension::lens);
+    auto ray_origin =
+        (defocus_angle <= 0) ? center : defocus_disk_sample(smp);
+    auto ray_direction = pixel_center - ray_origin;
+
+    smp.start_dimension(sample_dimension::time);
+    double delta_time = smp.get_1d() * shutter_time;
+    return ray(ray_origin, ray_direction, delta_time);
+  }
+
+  void record_stats(double seconds) {
+    last_stats.primary_rays = primary_rays;
+    last_stats.rays = rays_traced;
+    last_stats.seconds = seconds;
+    if (perf::enabled()) {
+      // Includes any phases counted before render(), such as the BVH build.
+      last_stats.perf = perf::take_totals();
+      std::clog << "\r";
+      perf::report(std::clog, last_stats.perf, rays_traced);
+    }
+    if (!instrument::enabled)
+      return;
+
+    // Rendering runs on this thread; its counts complete the total.
+    instrument::merge();
+    auto c = last_stats.counters = instrument::take_merged();
+    auto per = [](unsigned long long n, unsigned long long d) {
+      return d ? double(n) / d : 0.0;
+    };
+    std::clog << "\rPer ray: " << per(c.node_visits, rays_traced) << " nodes, "
+              << per(c.primitive_tests, rays_traced) << " primitive tests, "
+              << per(c.primitive_hits, rays_traced) << " primitive hits\n"
+              << "Per path: " << per(c.bounces, c.paths) << " bounces, "
+              << per(c.light_samples, c.paths) << " light samples, "
+              << per(c.shadow_rays, c.paths) << " shadow rays, "
+              << per(c.texture_fetches, c.paths) << " texture fetches\n";
+  }
+
+  color clamp_radiance(const color &c, int vertex) const {
+    if (radiance_clamp.empty())
+      return c;
+    auto limit = radiance_clamp[std::min<size_t>(vertex, radiance_clamp.size() - 1)];
+    auto peak = std::max(c.x(), std::max(c.y(), c.z()));
+    return (limit > 0 && peak > limit) ? c * (limit / peak) : c;
+  }
+
+  void render_adaptive(framebuffer &fb, const hittable &world,
+                       const hittable * lights, int first_pass) {
+    auto pixel_count = static_cast<long long>(image_width) * image_height;
+    auto budget = pixel_count * samples_per_pixel;
+    auto max_samples = adaptive_max_samples > 0 ? adaptive_max_samples
+                                                : 16 * samples_per_pixel;
+    auto batch = std::max(adaptive_min_samples, 2);
+
+    // First pass: every pixel gets enough samples for a variance estimate. After
+    // that the active set follows from the buffer, so a resumed render rebuilds it.
+    std::vector<int> active;
+    for (int p = 0; p < pixel_count; ++p) {
+      int i = p % image_width, j = p / image_width;
+      budget -= fb.samples(i, j);
+      if (first_pass == 0 || (fb.samples(i, j) < max_samples &&
+                              fb.relative_error(i, j) > adaptive_threshold))
+        active.push_back(p);
+    }
+
+    for (int pass = first_pass; !active.empty() && budget > 0; ++pass) {
+      std::clog << "\rAdaptive pass " << pass << ", active pixels: "
+                << active.size() << "        " << std::flush;
+
+      // Converged pixels drop out and the remaining budget is shared by the rest.
+      auto per_pixel = std::min<long long>(batch, budget / (long long)active.size());
+      if (per_pixel <= 0)
+        per_pixel = 1;
+
+      for (auto p : active) {
+        if (budget <= 0)
+          break;
+        int i = p % image_width, j = p / image_width;
+        auto n = int(std::min<long long>(per_pixel, budget));
+        add_samples(fb, i, j, n, world, lights);
+        budget -= n;
+      }
+
+      std::vector<int> still_active;
+      for (auto p : active) {
+        int i = p % image_width, j = p / image_width;
+        if (fb.samples(i, j) < max_samples &&
+            fb.relative_error(i, j) > adaptive_threshold)
+          still_active.push_back(p);
+      }
+      active.swap(still_active);
+      checkpoint(fb, pass + 1);
+    }
+  }
+
+  void render_progressive(framebuffer &fb, const hittable &world,
+                          const hittable * lights, int first_pass) {
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    auto deadline = start + std::chrono::duration<double>(time_budget);
+    auto samples = std::max(pass_samples, 1);
+
+    int passes = first_pass;
+    int total_samples = passes * samples;
+    auto pass_start = start;
+    clock::duration last_pass{0};
+    // Stop before a pass that would overrun the deadline at the last pass's speed.
+    while (pass_start + last_pass < deadline) {
+      for (int j = 0; j < image_height; ++j)
+        for (int i = 0; i < image_width; ++i)
+          add_samples(fb, i, j, samples, world, lights);
+      total_samples += samples;
+
+      write_image(output_path, fb);
+      checkpoint(fb, ++passes);
+
+      auto now = clock::now();
+      last_pass = now - pass_start;
+      pass_start = now;
+      std::clog << "\rProgressive: " << total_samples << " spp after "
+                << std::chrono::duration<double>(now - start).count() << "s   "
+                << std::flush;
+    }
+
+    std::chrono::duration<double> elapsed = clock::now() - start;
+    std::clog << "\nAchieved " << total_samples << " samples per pixel in "
+              << elapsed.count() << "s\n";
+  }
+
+  void render_wavefront(framebuffer &fb, const hittable &world, const hittable * lights,
+                        int first_row) {
+    auto per_row = size_t(image_width) * samples_per_pixel;
+    auto rows_per_batch = int(std::max<size_t>(1, size_t(std::max(wavefront_paths, 1)) / per_row));
+    path_buffer paths;
+    paths.resize(per_row * rows_per_batch, fb.has_aovs());
+    std::vector<uint32_t> queue, next, scratch;
+    auto &smp = *pixel_sampler;
+
+    for (int row = first_row; row < image_height; row += rows_per_batch) {
+      auto rows = std::min(rows_per_batch, image_height - row);
+      std::clog << "\rScanlines remaining: " << (image_height - row) << ' ' << std::flush;
+
+      // Generate: a camera ray for every sample of every pixel in the rows.
+      queue.clear();
+      uint32_t slots = 0;
+      for (int j = row; j < row + rows; ++j)
+        for (int i = 0; i < image_width; ++i) {
+          auto first_index = fb.samples(i, j);
+          for (int s = 0; s < samples_per_pixel; ++s, ++slots) {
+            smp.start_pixel_sample(i, j, first_index + s);
+            paths.set_ray(slots, primary_ray(smp, i, j));
+            paths.throughput[slots] = color(1, 1, 1);
+            paths.radiance[slots] = color(0, 0, 0);
+            paths.pdf[slots] = 0;
+            paths.pixel_i[slots] = i;
+            paths.pixel_j[slots] = j;
+            paths.sample[slots] = first_index + s;
+            if (fb.has_aovs())
+              paths.aov[slots] = aov_sample();
+            queue.push_back(slots);
+          }
+        }
+      primary_rays += slots;
+      RT_COUNT_N(paths, slots);
+
+      for (int bounce = 0; !queue.empty() && bounce < max_depth - 1; ++bounce) {
+        intersect_paths(paths, queue, world);
+        sort_queue(queue, scratch, path_buffer::bins, [&](uint32_t k) { return paths.bin[k]; });
+        next.clear();
+        shade_paths(paths, queue, next, bounce, world, lights);
+        sort_queue(next, scratch, 8, [&](uint32_t k) { return paths.octant(k); });
+        queue.swap(next);
+      }
+
+      // Slots are in pixel and sample order, the order the other modes add samples in.
+      for (uint32_t k = 0; k < slots; ++k) {
+        if (fb.has_aovs())
+          fb.add_sample(paths.pixel_i[k], paths.pixel_j[k], paths.radiance[k], paths.aov[k]);
+        else
+          fb.add_sample(paths.pixel_i[k], paths.pixel_j[k], paths.radiance[k]);
+      }
+      checkpoint(fb, row + rows);
+    }
+  }
+
+  // Intersect stage: the closest hit of each queued path's ray, in packets of
+  // consecutive queue entries when ray_packets is set.
+  void intersect_paths(path_buffer &paths, const std::vector<uint32_t> &queue,
+                       const hittable &world) const {
+    rays_traced += queue.size();
+    auto traversal_work = [] {
+      return instrument::enabled ? instrument::local.traversal_work() : 0ull;
+    };
+    auto add_cost = [&](uint32_t k, unsigned long long work) {
+      if constexpr (instrument::enabled)
+        if (!pixel_cost.empty())
+          pixel_cost[size_t(paths.pixel_j[k]) * image_width + paths.pixel_i[k]] += double(work);
+    };
+
+    if (!ray_packets) {
+      for (auto k : queue) {
+        auto work_before = traversal_work();
+        paths.set_hit(k, world.hit(paths.get_ray(k), interval(0.001, infinity), paths.rec[k]));
+        add_cost(k, traversal_work() - work_before);
+      }
+      return;
+    }
+
+    for (size_t q = 0; q < queue.size(); q += ray_packet::size) {
+      auto count = int(std::min<size_t>(ray_packet::size, queue.size() - q));
+      ray_packet rays;
+      for (int l = 0; l < count; ++l)
+        rays.add(paths.get_ray(queue[q + l]));
+      rays.finish();
+
+      auto work_before = traversal_work();
+      packet_hits hits;
+      world.hit_packet(rays, hits, rays.lanes());
+      auto work = traversal_work() - work_before;
+
+      for (int l = 0; l < count; ++l) {
+        auto k = queue[q + l];
+        bool hit = hits.mask >> l & 1;
+        if (hit)
+          paths.rec[k] = std::move(hits.rec[l]);
+        paths.set_hit(k, hit);
+        add_cost(k, work / count);
+      }
+    }
+  }
+
+  // Shade stage: adds each path's emission (or the background) and its directly sampled
+  // light, whose shadow rays are traced here, to its radiance and queues the paths that
+  // scatter, with their next ray, in next. The queue arrives
+  // sorted by shading bin, and each run of one bin goes through a kernel instantiated
+  // for its material class, so the material calls in it are direct and inlinable.
+  void shade_paths(path_buffer &paths, const std::vector<uint32_t> &queue,
+                   std::vector<uint32_t> &next, int bounce, const hittable &world,
+                   const hittable * lights) const {
+    for (size_t begin = 0, end; begin < queue.size(); begin = end) {
+      auto bin = paths.bin[queue[begin]];
+      for (end = begin + 1; end < queue.size() && paths.bin[queue[end]] == bin; ++end) {}
+      auto first = queue.data() + begin, last = queue.data() + end;
+
+      switch (bin == 0 ? -1 : bin - 1) {
+      case -1:
+        shade_misses(paths, first, last, bounce);
+        break;
+      case int(material_type::lambertian):
+        shade_hits<lambertian>(paths, first, last, next, bounce, world, lights);
+        break;
+      case int(material_type::metal):
+        shade_hits<metal>(paths, first, last, next, bounce, world, lights);
+        break;
+      case int(material_type::dielectric):
+        shade_hits<dielectric>(paths, first, last, next, bounce, world, lights);
+        break;
+      case int(material_type::diffuse_light):
+        shade_hits<diffuse_light>(paths, first, last, next, bounce, world, lights);
+        break;
+      case int(material_type::isotropic):
+        shade_hits<isotropic>(paths, first, last, next, bounce, world, lights);
+        break;
+      default:
+        shade_hits<material>(paths, first, last, next, bounce, world, lights);
+        break;
+      }
+    }
+  }
+
+  void shade_misses(path_buffer &paths, const uint32_t *first, const uint32_t *last,
+                    int bounce) const {
+    bool aovs = bounce == 0 && !paths.aov.empty();
+    for (auto k = first; k != last; ++k) {
+      paths.radiance[*k] += paths.throughput[*k] * background;
+      if (aovs)
+        paths.aov[*k].albedo = background;
+    }
+  }
+
+  // Paths whose hit material is an M, which is either one of the final material
+  // classes or material itself for the `other` bin.
+  template <typename M>
+  void shade_hits(path_buffer &paths, const uint32_t *first, const uint32_t *last,
+                  std::vector<uint32_t> &next, int bounce, const hittable &world,
+                  const hittable * lights) const {
+    bool aovs = bounce == 0 && !paths.aov.empty();
+    for (auto it = first; it != last; ++it) {
+      auto k = *it;
+      auto r = paths.get_ray(k);
+      const auto &rec = paths.rec[k];
+      if (aovs)
+        record_aov<M>(r, rec, paths.aov[k]);
+
+      pixel_sampler->resume_pixel_sample(paths.pixel_i[k], paths.pixel_j[k], paths.sample[k]);
+      ray scattered;
+      color emitted, attenuation;
+      bool scatters = scatter_at<M>(r, rec, bounce, world, lights, paths.pdf[k], emitted,
+                                    attenuation, scattered, paths.pdf[k]);
+      paths.radiance[k] += paths.throughput[k] * emitted;
+      if (!scatters)
+        continue;
+
+      RT_COUNT(bounces);
+      paths.throughput[k] = paths.throughput[k] * attenuation;
+      paths.set_ray(k, scattered);
+      next.push_back(k);
+    }
+  }
+
+  // Render mode tag stored in checkpoints so a resume cannot mix modes.
+  int render_mode() const { return time_budget > 0 ? 2 : adaptive ? 1 : 0; }
+
+  void checkpoint(const framebuffer &fb, int progress) {
+    if (checkpoint_interval <= 0)
+      return;
+    auto now = std::chrono::steady_clock::now();
+    if (std::chrono::duration<double>(now - last_checkpoint).count() < checkpoint_interval)
+      return;
+    last_checkpoint = now;
+
+    // Write to a temporary file first so a crash mid-write keeps the old checkpoint.
+    auto tmp_path = checkpoint_path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary);
+    int32_t header[9] = {checkpoint_magic, image_width, image_height, render_mode(),
+                         samples_per_pixel, fb.has_aovs(), fb.buckets(), int32_t(sizeof(real)),
+                         progress};
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    rng().save(out);
+    fb.save(out);
+    out.close();
+    if (out)
+      std::rename(tmp_path.c_str(), checkpoint_path.c_str());
+    else
+      std::clog << "\nFailed to write checkpoint " << tmp_path << "\n";
+  }
+
+  int load_checkpoint(framebuffer &fb) const {
+    std::ifstream in(checkpoint_path, std::ios::binary);
+    int32_t header[9];
+    if (!in.read(reinterpret_cast<char *>(header), sizeof(header))) {
+      std::clog << "No checkpoint at " << checkpoint_path << ", starting fresh\n";
+      return 0;
+    }
+    if (header[0] != checkpoint_magic || header[1] != image_width ||
+        header[2] != image_height || header[3] != render_mode() ||
+        header[4] != samples_per_pixel || header[5] != fb.has_aovs() ||
+        header[6] != fb.buckets() || header[7] != int32_t(sizeof(real))) {
+      std::clog << "Checkpoint " << checkpoint_path
+                << " does not match this render, starting fresh\n";
+      return 0;
+    }
+
+    pcg32 saved_rng;
+    framebuffer saved(image_width, image_height);
+    if (fb.has_aovs())
+      saved.enable_aovs();
+    if (fb.buckets() > 1)
+      saved.enable_buckets(fb.buckets());
+    if (!saved_rng.load(in) || !saved.load(in)) {
+      std::clog << "Checkpoint " << checkpoint_path << " is truncated, starting fresh\n";
+      return 0;
+    }
+
+    rng() = saved_rng;
+    fb = std::move(saved);
+    std::clog << "Resuming from " << checkpoint_path << " at step " << header[8] << "\n";
+    return header[8];
+  }
+
+  static constexpr int32_t checkpoint_magic = 0x4b435452; // "RTCK"
+
+  void write_image(const std::string &path, const framebuffer &fb) const {
+    writer->submit(path, fb.resolve());
+  }
+
+  void write_aovs(const std::string &path, const framebuffer &fb) const {
+    writer->submit(path, [path, w = fb.width(), h = fb.height(),
+                          channels = fb.aov_channels()] {
+      std::vector<std::string> names;
+      for (const auto &c : channels)
+        names.push_back(c.name);
+      exr_writer exr(path, w, h, names);
+      exr.write_image(channels);
+      return exr.close();
+    });
+  }
+
+  // Path next to output_path with the same extension, e.g. output/image_samples.ppm.
+  std::string output_sibling(const std::string &suffix) const {
+    auto dot = output_path.find_last_of('.');
+    if (dot == std::string::npos || dot < output_path.find_last_of('/') + 1)
+      return output_path + "_" + suffix;
+    return output_path.substr(0, dot) + "_" + suffix + output_path.substr(dot);
+  }
+
+  // Writes value(i, j) over a w x h image as a heatmap, normalized to the largest value.
+  template <typename F>
+  void write_heatmap(const std::string &path, int w, int h, F value,
+                     const char *what) const {
+    double max_value = 1;
+    for (int j = 0; j < h; ++j)
+      for (int i = 0; i < w; ++i)
+        max_value = std::max(max_value, value(i, j));
+
+    image_buffer img(w, h);
+    for (int j = 0; j < h; ++j)
+      for (int i = 0; i < w; ++i) {
+        // The ramp is display referred; square it so the writers' gamma restores it.
+        auto c = heatmap_color(value(i, j) / max_value);
+        img.set(i, j, c * c);
+      }
+    writer->submit(path, std::move(img));
+    std::clog << "\n" << what << ": max " << max_value << " per pixel, written to "
+              << path << "\n";
+  }
+
+  point3 defocus_disk_sample(sampler &smp) const {
     // Returns a random point in the camera defocus disk.
-    auto p = random_in_unit_disk();
+    auto [u1, u2] = smp.get_2d();
+    auto p = sample_unit_disk(u1, u2);
     return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
   }
 
   color ray_color(const ray &r, int depth, const hittable &world,
-                  const hittable * lights) const {
+                  const hittable * lights, aov_sample *aov = nullptr,
+                  double r_pdf = 0) const {
     if (--depth == 0) {
       return color(0, 0, 0);
     }
+    ++rays_traced;
 
     hit_record rec;
-    if (world.hit(r, interval(0.001, infinity), rec)) {
+    bool hit = world.hit(r, interval(0.001, infinity), rec);
+    return shade(r, depth, hit, rec, world, lights, aov, r_pdf);
+  }
+
+  // Radiance arriving along r, given its closest hit if there is one. depth counts the
+  // rays still allowed, r included, and r_pdf is as for scatter_at().
+  color shade(const ray &r, int depth, bool hit, const hit_record &rec,
+              const hittable &world, const hittable * lights,
+              aov_sample *aov = nullptr, double r_pdf = 0) const {
+    if (hit) {
+      if (aov)
+        record_aov(r, rec, *aov);
+
       ray scattered;
-      color attenuation;
-      color emitted = rec.mat->emitted(rec.u, rec.v, rec.p);
-
-      // sample pdf
-      std::initializer_list<double> weights = {0.5, 0.5};
-      std::shared_ptr<mixture_pdf> p_mix;
-      
-      if (lights != nullptr) {
-        std::initializer_list<std::shared_ptr<pdf>> pdfs = {
-            std::make_shared<cosine_pdf>(rec.normal),
-            std::make_shared<hittable_pdf>(*lights, rec.p)};
-        p_mix = std::make_shared<mixture_pdf>(pdfs, weights);
-      } else {
-        std::initializer_list<std::shared_ptr<pdf>> pdfs = {
-            std::make_shared<cosine_pdf>(rec.normal)};
-        p_mix = std::make_shared<mixture_pdf>(pdfs, weights);
+      color attenuation, emitted;
+      double scattered_pdf;
+      if (scatter_at(r, rec, max_depth - 1 - depth, world, lights, r_pdf, emitted,
+                     attenuation, scattered, scattered_pdf)) {
+        RT_COUNT(bounces);
+        auto incoming = ray_color(scattered, depth, world, lights, nullptr, scattered_pdf);
+        return attenuation * clamp_radiance(incoming, max_depth - depth) + emitted;
       }
-
-      if (rec.mat->scatter(r, p_mix, rec, attenuation, scattered))
-        return attenuation * ray_color(scattered, depth, world, lights) + emitted;
       return emitted;
     }
 
+    if (aov)
+      aov->albedo = background;
     return background;
     // background color
     // if(background != nullptr) return background
@@ -140,4 +854,79 @@ private:
     // auto a = 0.5 * (unit_direction.y() + 1.0);
     // return (1.0 - a) * color(1.0, 1.0, 1.0) + a * color(0.5, 0.7, 1.0);
   }
+
+  // M is the class of rec.mat when the caller knows it (see shade_hits), which makes
+  // the material calls below direct.
+  template <typename M = material>
+  void record_aov(const ray &r, const hit_record &rec, aov_sample &aov) const {
+    aov.albedo = static_cast<const M &>(*rec.mat).albedo_value(rec);
+    aov.normal = rec.normal;
+    aov.depth = rec.t * r.direction().length();
+    aov.hit = true;
+  }
+
+  // The path vertex at rec, the hit of r: the light it sends back along r other than
+  // through `scattered`, i.e. its emission plus the light sampled directly, and whether
+  // the path goes on and with which ray and attenuation. bounce numbers the vertex, 0 at
+  // the primary hit. r_pdf is the density the previous vertex sampled r with if it also
+  // sampled the lights, else 0, and scattered_pdf is the same for `scattered`.
+  template <typename M = material>
+  bool scatter_at(const ray &r, const hit_record &rec, int bounce, const hittable &world,
+                  const hittable * lights, double r_pdf, color &emitted,
+                  color &attenuation, ray &scattered, double &scattered_pdf) const {
+    const auto &mat = static_cast<const M &>(*rec.mat);
+    emitted = mat.emitted(rec.u, rec.v, rec.p);
+
+    // Light sampling at the previous vertex could have found this emission too; the
+    // two estimates share it by the balance heuristic.
+    if (r_pdf > 0 && emitted.length_squared() > 0) {
+      hittable_pdf light_pdf(*lights, r.origin());
+      emitted = emitted * mis_weight(r_pdf, light_pdf.value(r.direction(), rec));
+    }
+
+    scattered_pdf = 0;
+    pixel_sampler->start_dimension(sample_dimension::bsdf(bounce));
+    if (!mat.scatter(r, rec, attenuation, scattered, *pixel_sampler))
+      return false;
+
+    // Only while the path may still trace `scattered`, which could find the same light.
+    if (lights != nullptr && bounce + 2 < max_depth) {
+      scattered_pdf = mat.scattering_pdf(r, rec, scattered);
+      if (scattered_pdf > 0)
+        emitted += sample_light(r, rec, mat, bounce, world, *lights);
+    }
+    return true;
+  }
+
+  // Light reaching rec from a point sampled on the lights, times the BSDF and cosine
+  // over the sample's density, and weighted against BSDF sampling of the direction.
+  // The closest hit along the direction is the shadow test and gives the emission.
+  template <typename M>
+  color sample_light(const ray &r, const hit_record &rec, const M &mat, int bounce,
+                     const hittable &world, const hittable &lights) const {
+    pixel_sampler->start_dimension(sample_dimension::light(bounce));
+    auto [u1, u2] = pixel_sampler->get_2d();
+    hittable_pdf light_pdf(lights, rec.p);
+    light_sample ls;
+    if (!light_pdf.generate(u1, u2, ls))
+      return color(0, 0, 0);
+    ray shadow(rec.p, ls.p - rec.p, r.time());
+    auto bsdf_pdf = mat.scattering_pdf(r, rec, shadow);
+    if (bsdf_pdf <= 0)
+      return color(0, 0, 0);
+
+    ++rays_traced;
+    RT_COUNT(shadow_rays);
+    hit_record light_rec;
+    if (!world.hit(shadow, interval(0.001, infinity), light_rec))
+      return color(0, 0, 0);
+    auto light = light_rec.mat->emitted(light_rec.u, light_rec.v, light_rec.p);
+    if (light.length_squared() == 0)
+      return color(0, 0, 0);
+
+    light = clamp_radiance(light * mis_weight(ls.pdf, bsdf_pdf), bounce + 1);
+    return mat.scattering_value(r, rec, shadow) * light / ls.pdf;
+  }
+
+  static double mis_weight(double pdf, double other_pdf) { return pdf / (pdf + other_pdf); }
 };
\ No newline at end of file
@@ -16,6 +16,21 @@ vec3 linear2gamma(vec3 in)
     // pow(in, 1/2.2)
 }
 
+inline double luminance(const color &c)
+{
+    // Rec. 709 relative luminance of a linear rgb color.
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+inline color heatmap_color(double t)
+{
+    // Maps t in [0,1] onto a black-blue-red-yellow ramp.
+    t = interval(0, 1).clamp(t);
+    if (t < 1.0/3) return color(0, 0, 3*t);
+    if (t < 2.0/3) return color(3*t - 1, 0, 2 - 3*t);
+    return color(1, 3*t - 2, 0);
+}
+
 void write_color(std::ostream &out, color pixel_color, int samples_per_pixel) {
 
   assert(!std::isnan(pixel_color.x()) && !std::isnan(pixel_color.y()) &&
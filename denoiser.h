@@ -0,0 +1,165 @@
+#pragma once
+
+#include "framebuffer.h"
+#include "image_writer.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+class denoiser {
+  // Joint bilateral filter guided by the albedo, normal and depth AOVs. Lighting is
+  // filtered with the albedo divided out, so texture detail survives and only the noisy
+  // irradiance is smoothed across pixels with matching guides.
+  //
+  // The guides are float planes and each row is filtered one window offset at a time,
+  // so the inner loop runs over contiguous x with no branches and is vectorized by the
+  // compiler. Rows are split into bands, one per thread.
+  public:
+    int radius = 5;             // Window half width in pixels
+    float sigma_spatial = 3.0f;
+    float sigma_albedo = 0.1f;
+    float sigma_normal = 0.2f;  // In units of 1 - cos(angle)
+    float sigma_depth = 0.05f;  // Relative to the pixel's own depth
+    int threads = 0;            // 0 uses every hardware thread
+
+    image_buffer denoise(const framebuffer& fb) const {
+        auto w = fb.width(), h = fb.height();
+        auto channels = fb.aov_channels();
+        auto plane = [&](const char* name) -> std::vector<float>& {
+            for (auto& c : channels)
+                if (c.name == name) return c.data;
+            return channels.back().data;
+        };
+
+        guides g;
+        g.width = w;
+        const char* albedo_names[] = {"albedo.R", "albedo.G", "albedo.B"};
+        const char* normal_names[] = {"N.X", "N.Y", "N.Z"};
+        for (int c = 0; c < 3; ++c) {
+            g.albedo[c] = plane(albedo_names[c]).data();
+            g.normal[c] = plane(normal_names[c]).data();
+        }
+        g.depth = plane("Z").data();
+
+        // Demodulate: filter irradiance rather than radiance.
+        for (int c = 0; c < 3; ++c) {
+            auto& beauty = channels[c].data;
+            for (size_t i = 0; i < beauty.size(); ++i)
+                beauty[i] /= std::max(g.albedo[c][i], albedo_floor);
+            g.color[c] = beauty.data();
+        }
+
+        std::vector<float> out(size_t(w) * h * 3);
+        int n = threads > 0 ? threads : int(std::max(1u, std::thread::hardware_concurrency()));
+        n = std::min(n, h);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < n; ++t) {
+            int y0 = h * t / n, y1 = h * (t + 1) / n;
+            workers.emplace_back([&, y0, y1] { filter_rows(g, h, y0, y1, out.data()); });
+        }
+        for (auto& t : workers)
+            t.join();
+
+        image_buffer img(w, h);
+        for (int j = 0; j < h; ++j)
+            for (int i = 0; i < w; ++i) {
+                auto p = &out[(size_t(j) * w + i) * 3];
+                img.set(i, j, color(p[0], p[1], p[2]));
+            }
+        return img;
+    }
+
+  private:
+    static constexpr float albedo_floor = 0.01f;
+
+    struct guides {
+        int width;
+        const float* color[3];
+        const float* albedo[3];
+        const float* normal[3];
+        const float* depth;
+    };
+
+    static float approx_exp_neg(float x) {
+        // (1 - x/8)^8 ~ exp(-x) for x >= 0, cut to zero past 8. Cheap and vectorizable.
+        auto t = std::max(0.0f, 1.0f - x * 0.125f);
+        t *= t;
+        t *= t;
+        return t * t;
+    }
+
+    void filter_rows(const guides& g, int height, int y0, int y1, float* out) const {
+        auto w = g.width;
+        auto inv_spatial = 1.0f / (2 * sigma_spatial * sigma_spatial);
+        auto inv_albedo = 1.0f / (sigma_albedo * sigma_albedo);
+        auto inv_normal = 1.0f / sigma_normal;
+        auto inv_depth = 1.0f / (sigma_depth * sigma_depth);
+
+        std::vector<float> wsum(w), sr(w), sg(w), sb(w);
+        for (int y = y0; y < y1; ++y) {
+            std::fill(wsum.begin(), wsum.end(), 0.0f);
+            std::fill(sr.begin(), sr.end(), 0.0f);
+            std::fill(sg.begin(), sg.end(), 0.0f);
+            std::fill(sb.begin(), sb.end(), 0.0f);
+
+            size_t row = size_t(y) * w;
+            const float* ar = g.albedo[0] + row;
+            const float* ag = g.albedo[1] + row;
+            const float* ab = g.albedo[2] + row;
+            const float* nx = g.normal[0] + row;
+            const float* ny = g.normal[1] + row;
+            const float* nz = g.normal[2] + row;
+            const float* z = g.depth + row;
+
+            for (int dy = -radius; dy <= radius; ++dy) {
+                int yy = y + dy;
+                if (yy < 0 || yy >= height) continue;
+
+                for (int dx = -radius; dx <= radius; ++dx) {
+                    float spatial = (dx * dx + dy * dy) * inv_spatial;
+                    int x_begin = std::max(0, -dx), x_end = std::min(w, w - dx);
+
+                    // Row yy of the neighbor planes, read at x + dx. Shifting the row
+                    // pointer by dx instead would point before the plane at dx < 0.
+                    size_t nrow = size_t(yy) * w;
+                    const float* qr = g.color[0] + nrow;
+                    const float* qg = g.color[1] + nrow;
+                    const float* qb = g.color[2] + nrow;
+                    const float* qar = g.albedo[0] + nrow;
+                    const float* qag = g.albedo[1] + nrow;
+                    const float* qab = g.albedo[2] + nrow;
+                    const float* qnx = g.normal[0] + nrow;
+                    const float* qny = g.normal[1] + nrow;
+                    const float* qnz = g.normal[2] + nrow;
+                    const float* qz = g.depth + nrow;
+
+                    for (int x = x_begin; x < x_end; ++x) {
+                        int q = x + dx;
+                        auto dar = ar[x] - qar[q], dag = ag[x] - qag[q], dab = ab[x] - qab[q];
+                        auto da = dar * dar + dag * dag + dab * dab;
+                        auto dn = 1.0f - (nx[x] * qnx[q] + ny[x] * qny[q] + nz[x] * qnz[q]);
+                        auto dz = z[x] - qz[q];
+                        auto dz2 = dz * dz / (z[x] * z[x] + 1e-6f);
+
+                        auto wgt = approx_exp_neg(spatial + da * inv_albedo + dn * inv_normal
+                                                  + dz2 * inv_depth);
+                        wsum[x] += wgt;
+                        sr[x] += wgt * qr[q];
+                        sg[x] += wgt * qg[q];
+                        sb[x] += wgt * qb[q];
+                    }
+                }
+            }
+
+            // The center tap always has a positive weight, so wsum is never zero. Remodulate.
+            for (int x = 0; x < w; ++x) {
+                auto p = out + (row + x) * 3;
+                auto inv = 1.0f / wsum[x];
+                p[0] = sr[x] * inv * std::max(ar[x], albedo_floor);
+                p[1] = sg[x] * inv * std::max(ag[x], albedo_floor);
+                p[2] = sb[x] * inv * std::max(ab[x], albedo_floor);
+            }
+        }
+    }
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// One named float channel of a full image, stored row major.
+class exr_channel {
+  public:
+    std::string name;
+    std::vector<float> data;
+};
+
+class exr_writer {
+  // Writes single part, tiled, uncompressed OpenEXR files with FLOAT channels.
+  // Tiles may be written in any order; the offset table is reserved after the header
+  // and filled in by close(), so finished tiles can be streamed straight to disk.
+  public:
+    exr_writer(const std::string& path, int width, int height, std::vector<std::string> channels,
+               int tile_size = 64, bool random_order = false)
+      : image_width(width), image_height(height), tile(tile_size), names(std::move(channels)),
+        out(path, std::ios::binary)
+    {
+        // Channels must be stored in alphabetical order; remember where each one went.
+        auto sorted = names;
+        std::sort(sorted.begin(), sorted.end());
+        for (const auto& n : names)
+            order.push_back(int(std::find(sorted.begin(), sorted.end(), n) - sorted.begin()));
+
+        tiles_x = (image_width + tile - 1) / tile;
+        tiles_y = (image_height + tile - 1) / tile;
+        offsets.assign(size_t(tiles_x) * tiles_y, 0);
+
+        std::vector<char> h;
+        put(h, int32_t(20000630));  // Magic number
+        put(h, int32_t(2 | 0x200)); // Version 2, tiled
+
+        std::vector<char> chlist;
+        for (const auto& n : sorted) {
+            chlist.insert(chlist.end(), n.begin(), n.end());
+            chlist.push_back(0);
+            put(chlist, int32_t(2)); // FLOAT
+            put(chlist, int32_t(0)); // pLinear and reserved bytes
+            put(chlist, int32_t(1)); // x sampling
+            put(chlist, int32_t(1)); // y sampling
+        }
+        chlist.push_back(0);
+        attribute(h, "channels", "chlist", chlist);
+
+        attribute(h, "compression", "compression", {0});
+
+        std::vector<char> window;
+        put(window, int32_t(0));
+        put(window, int32_t(0));
+        put(window, int32_t(image_width - 1));
+        put(window, int32_t(image_height - 1));
+        attribute(h, "dataWindow", "box2i", window);
+        attribute(h, "displayWindow", "box2i", window);
+
+        attribute(h, "lineOrder", "lineOrder", {char(random_order ? 2 : 0)});
+
+        std::vector<char> v;
+        put(v, 1.0f);
+        attribute(h, "pixelAspectRatio", "float", v);
+        attribute(h, "screenWindowWidth", "float", v);
+        v.clear();
+        put(v, 0.0f);
+        put(v, 0.0f);
+        attribute(h, "screenWindowCenter", "v2f", v);
+
+        v.clear();
+        put(v, uint32_t(tile));
+        put(v, uint32_t(tile));
+        v.push_back(0); // ONE_LEVEL, round down
+        attribute(h, "tiles", "tiledesc", v);
+
+        h.push_back(0); // End of header
+
+        out.write(h.data(), h.size());
+        table_pos = out.tellp();
+        out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+    }
+
+    ~exr_writer() { close(); }
+
+    int tiles_across() const { return tiles_x; }
+    int tiles_down() const { return tiles_y; }
+    int tile_size() const { return tile; }
+
+    // Pixel extent of tile (tx, ty); edge tiles are clipped to the image.
+    int tile_width(int tx) const { return std::min(tile, image_width - tx * tile); }
+    int tile_height(int ty) const { return std::min(tile, image_height - ty * tile); }
+
+    // planes[c] holds channel c (in constructor order) for the tile, row major with a
+    // stride of tile_width(tx).
+    void write_tile(int tx, int ty, const std::vector<const float*>& planes) {
+        auto w = tile_width(tx), h = tile_height(ty);
+        std::vector<const float*> sorted(planes.size());
+        for (size_t c = 0; c < planes.size(); ++c)
+            sorted[order[c]] = planes[c];
+
+        std::vector<char> chunk;
+        put(chunk, int32_t(tx));
+        put(chunk, int32_t(ty));
+        put(chunk, int32_t(0)); // Level x
+        put(chunk, int32_t(0)); // Level y
+        put(chunk, int32_t(sizeof(float) * w * h * sorted.size()));
+        for (int y = 0; y < h; ++y)
+            for (auto plane : sorted) {
+                auto row = reinterpret_cast<const char*>(plane + size_t(y) * w);
+                chunk.insert(chunk.end(), row, row + sizeof(float) * w);
+            }
+
+        offsets[size_t(ty) * tiles_x + tx] = uint64_t(out.tellp());
+        out.write(chunk.data(), chunk.size());
+    }
+
+    // Writes every tile of full size channels.
+    void write_image(const std::vector<exr_channel>& channels) {
+        std::vector<std::vector<float>> buffers(channels.size());
+        std::vector<const float*> planes(channels.size());
+        for (int ty = 0; ty < tiles_y; ++ty)
+            for (int tx = 0; tx < tiles_x; ++tx) {
+                auto w = tile_width(tx), h = tile_height(ty);
+                for (size_t c = 0; c < channels.size(); ++c) {
+                    buffers[c].resize(size_t(w) * h);
+                    for (int y = 0; y < h; ++y)
+                        std::copy_n(&channels[c].data[size_t(ty * tile + y) * image_width + tx * tile],
+                                    w, &buffers[c][size_t(y) * w]);
+                    planes[c] = buffers[c].data();
+                }
+                write_tile(tx, ty, planes);
+            }
+    }
+
+    bool close() {
+        if (!out.is_open())
+            return ok;
+        out.seekp(table_pos);
+        out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+        out.close();
+        ok = !out.fail();
+        return ok;
+    }
+
+  private:
+    int image_width, image_height;
+    int tile;
+    int tiles_x = 0, tiles_y = 0;
+    std::vector<std::string> names;
+    std::vector<int> order;
+    std::vector<uint64_t> offsets;
+    std::ofstream out;
+    std::streampos table_pos;
+    bool ok = true;
+
+    // EXR is little endian, as are all targets this renderer builds for.
+    template <typename T>
+    static void put(std::vector<char>& buf, T value) {
+        char bytes[sizeof(T)];
+        std::memcpy(bytes, &value, sizeof(T));
+        buf.insert(buf.end(), bytes, bytes + sizeof(T));
+    }
+
+    static void attribute(std::vector<char>& buf, const char* name, const char* type,
+                          const std::vector<char>& value) {
+        buf.insert(buf.end(), name, name + std::strlen(name) + 1);
+        buf.insert(buf.end(), type, type + std::strlen(type) + 1);
+        put(buf, int32_t(value.size()));
+        buf.insert(buf.end(), value.begin(), value.end());
+    }
+};
@@ -0,0 +1,235 @@
+#pragma once
+
+#include "color.h"
+#include "exr_writer.h"
+#include "image_writer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Surface data recorded at a sample's primary hit.
+class aov_sample {
+  public:
+    color albedo{0,0,0};
+    vec3 normal{0,0,0};
+    double depth = 0; // Distance to the primary hit
+    bool hit = false;
+};
+
+// Running sum of colors, kept in double whatever the scalar type so that late samples
+// of a long float render still register against a large total.
+class color_sum {
+  public:
+    color_sum& operator+=(const vec3& c) {
+        for (int k = 0; k < 3; ++k)
+            e[k] += c[k];
+        return *this;
+    }
+
+    double operator[](int k) const { return e[k]; }
+
+    color operator/(double n) const { return color(real(e[0] / n), real(e[1] / n), real(e[2] / n)); }
+
+  private:
+    double e[3] = {0, 0, 0};
+};
+
+class framebuffer {
+  public:
+    framebuffer() = default;
+
+    framebuffer(int w, int h)
+      : image_width(w), image_height(h), sums(size_t(w) * h), counts(size_t(w) * h, 0),
+        means(size_t(w) * h, 0.0), m2s(size_t(w) * h, 0.0) {}
+
+    int width() const { return image_width; }
+    int height() const { return image_height; }
+
+    // Allocates the albedo, normal and depth accumulators.
+    void enable_aovs() {
+        auto n = size_t(image_width) * image_height;
+        albedo_sums.assign(n, color_sum());
+        normal_sums.assign(n, color_sum());
+        depth_sums.assign(n, 0.0);
+        depth_counts.assign(n, 0);
+    }
+
+    bool has_aovs() const { return !albedo_sums.empty(); }
+
+    // Splits each pixel's samples round robin over n buckets for median of means.
+    void enable_buckets(int n) {
+        bucket_count = std::min(n, max_buckets);
+        bucket_sums.assign(size_t(image_width) * image_height * bucket_count, color_sum());
+    }
+
+    int buckets() const { return bucket_count; }
+
+    void add_sample(int i, int j, const color& c, const aov_sample& aov) {
+        add_sample(i, j, c);
+        if (!has_aovs()) return;
+
+        auto idx = index(i, j);
+        albedo_sums[idx] += aov.albedo;
+        normal_sums[idx] += aov.normal;
+        if (aov.hit) {
+            depth_sums[idx] += aov.depth;
+            depth_counts[idx]++;
+        }
+    }
+
+    void add_sample(int i, int j, const color& c) {
+        auto idx = index(i, j);
+        if (bucket_count > 1)
+            bucket_sums[idx * bucket_count + counts[idx] % bucket_count] += c;
+        sums[idx] += c;
+
+        // Welford's running mean and variance of the sample luminance.
+        auto n = ++counts[idx];
+        auto y = luminance(c);
+        auto delta = y - means[idx];
+        means[idx] += delta / n;
+        m2s[idx] += delta * (y - means[idx]);
+    }
+
+    // Sum of all samples taken in the pixel.
+    const color_sum& sum(int i, int j) const { return sums[index(i, j)]; }
+
+    int samples(int i, int j) const { return counts[index(i, j)]; }
+
+    // Pixel estimate: the mean, or with buckets the per channel median of bucket means,
+    // which a single firefly sample cannot drag far from the typical value.
+    color average(int i, int j) const {
+        auto n = samples(i, j);
+        if (n <= 0) return color(0,0,0);
+        if (bucket_count <= 1 || n < bucket_count) return sum(i, j) / n;
+
+        color means_of_buckets[max_buckets];
+        auto k = bucket_count;
+        auto first = &bucket_sums[index(i, j) * bucket_count];
+        for (int b = 0; b < k; ++b) {
+            // Bucket b holds samples b, b + k, b + 2k, ...
+            auto in_bucket = n / k + (b < n % k ? 1 : 0);
+            means_of_buckets[b] = first[b] / in_bucket;
+        }
+
+        color result;
+        double values[max_buckets];
+        for (int c = 0; c < 3; ++c) {
+            for (int b = 0; b < k; ++b)
+                values[b] = means_of_buckets[b][c];
+            std::sort(values, values + k);
+            result[c] = (k % 2) ? values[k / 2] : 0.5 * (values[k / 2 - 1] + values[k / 2]);
+        }
+        return result;
+    }
+
+    double variance(int i, int j) const {
+        auto n = samples(i, j);
+        return n > 1 ? m2s[index(i, j)] / (n - 1) : 0.0;
+    }
+
+    double relative_error(int i, int j) const {
+        // Standard error of the pixel mean relative to the mean. The small floor keeps
+        // near black pixels from demanding an unbounded number of samples.
+        auto n = samples(i, j);
+        if (n < 2) return infinity;
+        auto std_error = std::sqrt(variance(i, j) / n);
+        return std_error / (means[index(i, j)] + 1e-3);
+    }
+
+    // Beauty, albedo, normal, depth and sample count channels for the EXR writer; the
+    // albedo, normal and depth channels only when AOVs are enabled. Depth averages only
+    // over samples that hit something; misses leave it at 0.
+    std::vector<exr_channel> aov_channels() const {
+        std::vector<exr_channel> channels;
+        for (const auto& n : channel_names())
+            channels.push_back({n, std::vector<float>(size_t(image_width) * image_height)});
+        auto& samples = channels.back();
+
+        for (size_t idx = 0; idx < sums.size(); ++idx) {
+            auto n = std::max(counts[idx], 1);
+            auto beauty = average(int(idx % image_width), int(idx / image_width));
+            for (int c = 0; c < 3; ++c) {
+                channels[c].data[idx] = float(beauty[c]);
+                if (has_aovs()) {
+                    channels[3 + c].data[idx] = float(albedo_sums[idx][c] / n);
+                    channels[6 + c].data[idx] = float(normal_sums[idx][c] / n);
+                }
+            }
+            if (has_aovs() && depth_counts[idx] > 0)
+                channels[9].data[idx] = float(depth_sums[idx] / depth_counts[idx]);
+            samples.data[idx] = float(counts[idx]);
+        }
+        return channels;
+    }
+
+    std::vector<std::string> channel_names() const {
+        if (has_aovs())
+            return {"R", "G", "B", "albedo.R", "albedo.G", "albedo.B",
+                    "N.X", "N.Y", "N.Z", "Z", "samples"};
+        return {"R", "G", "B", "samples"};
+    }
+
+    // Per pixel averages as a float image for the writers.
+    image_buffer resolve() const {
+        image_buffer img(image_width, image_height);
+        for (int j = 0; j < image_height; ++j)
+            for (int i = 0; i < image_width; ++i)
+                img.set(i, j, average(i, j));
+        return img;
+    }
+
+    void save(std::ostream& out) const {
+        write(out, sums);
+        write(out, counts);
+        write(out, means);
+        write(out, m2s);
+        write(out, bucket_sums);
+        if (has_aovs()) {
+            write(out, albedo_sums);
+            write(out, normal_sums);
+            write(out, depth_sums);
+            write(out, depth_counts);
+        }
+    }
+
+    bool load(std::istream& in) {
+        // The buffer must already have the checkpoint's dimensions, AOV and bucket settings.
+        return read(in, sums) && read(in, counts) && read(in, means) && read(in, m2s)
+            && read(in, bucket_sums) && read(in, albedo_sums) && read(in, normal_sums) && read(in, depth_sums)
+            && read(in, depth_counts);
+    }
+
+  private:
+    int image_width = 0;
+    int image_height = 0;
+    std::vector<color_sum> sums;
+    std::vector<int> counts;
+    std::vector<double> means;
+    std::vector<double> m2s;
+
+    static constexpr int max_buckets = 64;
+    int bucket_count = 0;
+    std::vector<color_sum> bucket_sums;
+
+    std::vector<color_sum> albedo_sums;
+    std::vector<color_sum> normal_sums;
+    std::vector<double> depth_sums;
+    std::vector<int> depth_counts;
+
+    size_t index(int i, int j) const { return size_t(j) * image_width + i; }
+
+    template <typename T>
+    static void write(std::ostream& out, const std::vector<T>& v) {
+        out.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+    }
+
+    template <typename T>
+    static bool read(std::istream& in, std::vector<T>& v) {
+        in.read(reinterpret_cast<char*>(v.data()), v.size() * sizeof(T));
+        return bool(in);
+    }
+};
@@ -3,19 +3,23 @@
 #include "ray.h"
 #include "interval.h"
 #include "aabb.h"
+#include "ray_packet.h"
 #include <memory>
 #include <algorithm>
 
 class material;
+class hittable;
+class primitive;
 
 class hit_record {
   public:
-    double u, v;
+    real u, v;
     point3 p;
     vec3 normal;
-    double t;
+    real t;
     bool front_face;
     std::shared_ptr<material> mat;
+    const hittable* object = nullptr; // Primitive that produced the hit
 
     void set_face_normal(const ray& r, const vec3& outward_normal) {
         // Sets the hit record normal vector.
@@ -26,12 +30,100 @@ class hit_record {
     }    
 };
 
+// The closest hit found so far by a BVH traversal or a hittable_list, before any hit
+// record is built: its distance and the primitive's surface coordinates (plane
+// coordinates of a quad, barycentrics of a triangle). Only the final closest hit is
+// completed into a hit_record, so its point, normal, uv and material are computed once
+// per ray.
+class surface_hit {
+  public:
+    real t = infinity;
+    real a = 0, b = 0;
+    const primitive* prim = nullptr;
+    bool deferred = false; // False when the hit record was written in full instead
+};
+
+class light_sample {
+  public:
+    point3 p;        // Sampled point on the light
+    vec3 normal;     // Light surface normal at p
+    real distance; // Distance from the shading point to p
+    double pdf;      // Solid angle density of the direction towards p
+};
+
+// Closest hit found so far for each lane of a ray_packet. t starts at infinity and only
+// shrinks, so it is also the upper end of each lane's ray interval.
+class packet_hits {
+  public:
+    real t[ray_packet::size];
+    hit_record rec[ray_packet::size];
+    surface_hit pending[ray_packet::size]; // Lanes whose rec is still to be completed
+    const hittable* owner[ray_packet::size] = {}; // Completes a pending lane; null for a BVH's
+    unsigned mask = 0; // Lanes with a hit
+
+    packet_hits() { std::fill(t, t + ray_packet::size, real(infinity)); }
+
+    void set(int k, const hit_record& r) {
+        rec[k] = r;
+        mark(k);
+    }
+
+    // Records a hit already written to rec[k].
+    void mark(int k) {
+        t[k] = rec[k].t;
+        mask |= 1u << k;
+        pending[k].deferred = false;
+    }
+
+    // Records a hit whose rec[k] is completed later: by the BVH that found it before it
+    // returns, or by `by` when the hittable_list searching for it has finished.
+    void defer(int k, const surface_hit& h, const hittable* by = nullptr) {
+        t[k] = h.t;
+        mask |= 1u << k;
+        pending[k] = h;
+        owner[k] = by;
+    }
+};
+
 class hittable {
   public:
     virtual ~hittable() = default;
 
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
 
+    // hit() split in two for closest hit searches over several objects: intersect()
+    // finds the hit and may leave its record to complete(), which the search then calls
+    // on the closest hit only. Objects that do not split write rec in full here and
+    // leave h.deferred false.
+    virtual bool intersect(const ray& r, interval ray_t, surface_hit& h, hit_record& rec) const
+    {
+      if (!hit(r, ray_t, rec))
+        return false;
+      h.t = rec.t;
+      h.deferred = false;
+      return true;
+    }
+
+    virtual void complete(const ray& r, const surface_hit& h, hit_record& rec) const {}
+
+    // Intersects the lanes of `mask` in rays, updating hits wherever a lane finds a hit
+    // closer than hits.t. Objects without a packet kernel trace the lanes one by one.
+    virtual void hit_packet(const ray_packet& rays, packet_hits& hits, unsigned mask) const
+    {
+      for (int k = 0; k < ray_packet::size; ++k) {
+        hit_record rec;
+        if ((mask >> k & 1) && hit(rays.get(k), interval(rays.t_min, hits.t[k]), rec))
+          hits.set(k, rec);
+      }
+    }
+
+    // hit_packet() split like hit(): objects with a packet kernel leave their lanes
+    // pending with themselves as owner, for the search to complete() at its end.
+    virtual void intersect_packet(const ray_packet& rays, packet_hits& hits, unsigned mask) const
+    {
+      hit_packet(rays, hits, mask);
+    }
+
     virtual aabb bounding_box() const = 0;
 
     virtual double pdf_value(const point3& origin, const vec3 &v) const
@@ -43,6 +135,28 @@ class hittable {
     {
       return vec3(1,0,0);
     }
+
+    // Samples a point on the object as seen from origin, returning the point, normal,
+    // distance and pdf together. u1 and u2 are uniform in [0,1) and come from the pixel
+    // sampler; groups of lights spend u1 on picking one first, then pass it on rescaled
+    // to [0,1). Returns false if no valid sample exists.
+    virtual bool sample(const point3 &origin, double u1, double u2, light_sample &ls) const
+    {
+      return false;
+    }
+
+    // pdf_value() for a direction whose intersection `rec` is already known, e.g. a BSDF
+    // sampled ray, so the object does not have to be hit again.
+    virtual double hit_pdf_value(const point3 &origin, const vec3 &v, const hit_record &rec) const
+    {
+      return 0.0;
+    }
+
+    // Emitted luminance times surface area, used to weight light selection.
+    virtual double emitted_power() const
+    {
+      return 0.0;
+    }
 };
 
 class rotate_y : public hittable {
@@ -50,11 +164,11 @@ class rotate_y : public hittable {
     rotate_y(std::shared_ptr<hittable> p, double angle): ptr(p), sin_theta(sin(angle)), cos_theta(cos(angle))
     {
       bbox = p->bounding_box();
-      double x[4] = {bbox.x.min, bbox.x.min, bbox.x.max, bbox.x.max};
-      double z[4] = {bbox.z.min, bbox.z.max, bbox.z.min, bbox.z.max};
+      real x[4] = {bbox.x.min, bbox.x.min, bbox.x.max, bbox.x.max};
+      real z[4] = {bbox.z.min, bbox.z.max, bbox.z.min, bbox.z.max};
 
-      double max_x = 0, min_x = 0;
-      double max_z = 0, min_z = 0;
+      real max_x = 0, min_x = 0;
+      real max_z = 0, min_z = 0;
       max_x = min_x = cos_theta * x[0] + sin_theta * z[0];
       max_z = min_z = -sin_theta * x[0] + cos_theta * z[0];
 
@@ -118,10 +232,12 @@ class rotate_y : public hittable {
         return bbox;
     }
 
+    double emitted_power() const override { return ptr->emitted_power(); }
+
   public:
     std::shared_ptr<hittable> ptr;
-    float sin_theta;
-    float cos_theta;
+    real sin_theta;
+    real cos_theta;
     bool hasbox;
     aabb bbox;
 };
@@ -151,7 +267,9 @@ class translate : public hittable {
 
     aabb bounding_box() const override { return bbox; }
 
-  private:
+    double emitted_power() const override { return object->emitted_power(); }
+
+  public:
     std::shared_ptr<hittable> object;
     vec3 offset;
     aabb bbox;
@@ -23,20 +23,39 @@ class hittable_list : public hittable {
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        hit_record temp_rec;
+        // Only the closest hit's record is built, by the object that found it.
+        surface_hit closest;
+        const hittable* deferred_by = nullptr;
         bool hit_anything = false;
-        
+
         for (const auto& object : objects) {
-            if (object->hit(r, ray_t, temp_rec)) {
+            if (object->intersect(r, ray_t, closest, rec)) {
                 hit_anything = true;
-                ray_t.max = temp_rec.t;
-                rec = temp_rec;
+                ray_t.max = closest.t;
+                deferred_by = closest.deferred ? object.get() : nullptr;
             }
         }
 
+        if (deferred_by)
+            deferred_by->complete(r, closest, rec);
         return hit_anything;
     }
 
+    void hit_packet(const ray_packet& rays, packet_hits& hits, unsigned mask) const override {
+        // As hit(), completing each lane's closest hit once all objects are searched.
+        // Lanes a BVH deferred have no owner and were completed by that BVH.
+        for (const auto& object : objects)
+            object->intersect_packet(rays, hits, mask);
+
+        for (int k = 0; k < ray_packet::size; ++k) {
+            auto& pending = hits.pending[k];
+            if (pending.deferred && hits.owner[k]) {
+                hits.owner[k]->complete(rays.get(k), pending, hits.rec[k]);
+                pending.deferred = false;
+            }
+        }
+    }
+
     aabb bounding_box() const override
     {
         return bbox;
@@ -60,6 +79,36 @@ class hittable_list : public hittable {
         return objects[random_int(0, objects.size()-1)]->random(origin);
     }
 
+    bool sample(const point3& origin, double u1, double u2, light_sample& ls) const override {
+        if (objects.empty())
+            return false;
+        // Uniform choice; what is left of u1 past the index is uniform in [0,1) again.
+        auto scaled = u1 * objects.size();
+        auto i = std::min(size_t(scaled), objects.size() - 1);
+        if (!objects[i]->sample(origin, scaled - i, u2, ls))
+            return false;
+
+        // Objects may overlap in solid angle, so the density is that of the whole mixture.
+        ls.pdf = pdf_value(origin, ls.p - origin);
+        return ls.pdf > 0;
+    }
+
+    double hit_pdf_value(const point3& origin, const vec3& v, const hit_record& rec) const override {
+        // pdf_value(), with the object that was hit evaluated from the hit.
+        auto sum = 0.0;
+        for (const auto& object : objects)
+            sum += object.get() == rec.object ? object->hit_pdf_value(origin, v, rec)
+                                              : object->pdf_value(origin, v);
+        return sum / objects.size();
+    }
+
+    double emitted_power() const override {
+        auto sum = 0.0;
+        for (const auto& object : objects)
+            sum += object->emitted_power();
+        return sum;
+    }
+
 private:
     aabb bbox{interval::empty, interval::empty, interval::empty};
 };
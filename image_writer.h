@@ -0,0 +1,296 @@
+#pragma once
+
+#include "color.h"
+#include "interval.h"
+
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Linear rgb image with float channels, as handed to the writers.
+class image_buffer {
+  public:
+    image_buffer() = default;
+
+    image_buffer(int w, int h) : image_width(w), image_height(h), data(size_t(w) * h * 3, 0.0f) {}
+
+    int width() const { return image_width; }
+    int height() const { return image_height; }
+
+    void set(int i, int j, const color& c) {
+        auto p = &data[(size_t(j) * image_width + i) * 3];
+        p[0] = float(c.x());
+        p[1] = float(c.y());
+        p[2] = float(c.z());
+    }
+
+    const float* pixel(int i, int j) const { return &data[(size_t(j) * image_width + i) * 3]; }
+
+  private:
+    int image_width = 0;
+    int image_height = 0;
+    std::vector<float> data;
+};
+
+namespace image_io {
+
+// Display encoding shared by the integer formats: sqrt gamma and clamp, as write_color().
+// NaN maps to black, since it would pass through the clamp and the integer cast is
+// undefined for it.
+inline double encode(float linear) {
+    static const interval intensity(0, 0.99999);
+    if (std::isnan(linear))
+        return 0;
+    return intensity.clamp(std::sqrt(std::max(linear, 0.0f)));
+}
+
+inline bool write_ppm(const std::string& path, const image_buffer& img) {
+    // Binary P6 with 8 bits per channel.
+    std::vector<unsigned char> row(size_t(img.width()) * 3);
+    std::ofstream out(path, std::ios::binary);
+    out << "P6\n" << img.width() << ' ' << img.height() << "\n255\n";
+    for (int j = 0; j < img.height(); ++j) {
+        auto p = img.pixel(0, j);
+        for (size_t k = 0; k < row.size(); ++k)
+            row[k] = static_cast<unsigned char>(256 * encode(p[k]));
+        out.write(reinterpret_cast<const char*>(row.data()), row.size());
+    }
+    return bool(out);
+}
+
+inline bool write_pfm(const std::string& path, const image_buffer& img) {
+    // Portable float map: linear data, little endian, rows stored bottom to top.
+    std::ofstream out(path, std::ios::binary);
+    out << "PF\n" << img.width() << ' ' << img.height() << "\n-1.0\n";
+    for (int j = img.height() - 1; j >= 0; --j)
+        out.write(reinterpret_cast<const char*>(img.pixel(0, j)),
+                  sizeof(float) * 3 * img.width());
+    return bool(out);
+}
+
+// Reads a little endian rgb PFM as written by write_pfm(). Returns false on any other
+// variant of the format.
+inline bool read_pfm(const std::string& path, image_buffer& img) {
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    int w = 0, h = 0;
+    double scale = 0;
+    if (!(in >> magic >> w >> h >> scale) || magic != "PF" || w <= 0 || h <= 0 || scale >= 0)
+        return false;
+    in.get(); // Single whitespace before the data
+
+    img = image_buffer(w, h);
+    std::vector<float> row(size_t(w) * 3);
+    for (int j = h - 1; j >= 0; --j) {
+        if (!in.read(reinterpret_cast<char*>(row.data()), row.size() * sizeof(float)))
+            return false;
+        for (int i = 0; i < w; ++i)
+            img.set(i, j, color(row[3*i], row[3*i + 1], row[3*i + 2]));
+    }
+    return true;
+}
+
+// Root mean square difference of two same sized images after display encoding, so the
+// figure tracks visible error and a few unclamped fireflies do not dominate it.
+inline double rmse(const image_buffer& a, const image_buffer& b) {
+    double sum = 0;
+    for (int j = 0; j < a.height(); ++j) {
+        auto p = a.pixel(0, j), q = b.pixel(0, j);
+        for (int k = 0; k < a.width() * 3; ++k) {
+            auto d = encode(p[k]) - encode(q[k]);
+            sum += d * d;
+        }
+    }
+    return std::sqrt(sum / (3.0 * a.width() * a.height()));
+}
+
+inline uint32_t crc32(const unsigned char* data, size_t size, uint32_t crc = 0) {
+    static const auto table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+inline void put_u32(std::vector<unsigned char>& out, uint32_t v) {
+    out.push_back(v >> 24);
+    out.push_back(v >> 16);
+    out.push_back(v >> 8);
+    out.push_back(v);
+}
+
+inline void write_png_chunk(std::ostream& out, const char* type,
+                            const std::vector<unsigned char>& payload) {
+    std::vector<unsigned char> chunk;
+    put_u32(chunk, uint32_t(payload.size()));
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), payload.begin(), payload.end());
+    put_u32(chunk, crc32(chunk.data() + 4, chunk.size() - 4));
+    out.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+}
+
+inline bool write_png16(const std::string& path, const image_buffer& img) {
+    // 16 bit rgb PNG. The zlib stream uses stored (uncompressed) deflate blocks, which
+    // keeps the writer dependency free and cheap enough to run per pass.
+    std::vector<unsigned char> raw;
+    raw.reserve(size_t(img.height()) * (1 + size_t(img.width()) * 6));
+    for (int j = 0; j < img.height(); ++j) {
+        raw.push_back(0); // Filter type: none
+        auto p = img.pixel(0, j);
+        for (int k = 0; k < img.width() * 3; ++k) {
+            auto v = static_cast<uint16_t>(65536 * encode(p[k]));
+            raw.push_back(v >> 8);
+            raw.push_back(v & 0xff);
+        }
+    }
+
+    std::vector<unsigned char> zlib = {0x78, 0x01};
+    for (size_t pos = 0; pos < raw.size() || pos == 0; ) {
+        auto len = std::min<size_t>(65535, raw.size() - pos);
+        bool last = pos + len == raw.size();
+        zlib.push_back(last ? 1 : 0);
+        zlib.push_back(len & 0xff);
+        zlib.push_back(len >> 8);
+        zlib.push_back(~len & 0xff);
+        zlib.push_back((~len >> 8) & 0xff);
+        zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + len);
+        pos += len;
+        if (last) break;
+    }
+
+    uint32_t a = 1, b = 0; // Adler-32 of the uncompressed data
+    for (auto c : raw) {
+        a = (a + c) % 65521;
+        b = (b + a) % 65521;
+    }
+    put_u32(zlib, (b << 16) | a);
+
+    std::vector<unsigned char> ihdr;
+    put_u32(ihdr, img.width());
+    put_u32(ihdr, img.height());
+    ihdr.insert(ihdr.end(), {16, 2, 0, 0, 0}); // 16 bit, truecolor, no interlace
+
+    std::ofstream out(path, std::ios::binary);
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    out.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+    write_png_chunk(out, "IHDR", ihdr);
+    write_png_chunk(out, "IDAT", zlib);
+    write_png_chunk(out, "IEND", {});
+    return bool(out);
+}
+
+inline bool ends_with(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Picks the format from the file extension: .pfm, .png, anything else is binary PPM.
+inline bool write_image(const std::string& path, const image_buffer& img) {
+    if (ends_with(path, ".pfm")) return write_pfm(path, img);
+    if (ends_with(path, ".png")) return write_png16(path, img);
+    return write_ppm(path, img);
+}
+
+} // namespace image_io
+
+class async_image_writer {
+  // Encodes and writes images on a background thread so output overlaps rendering.
+  public:
+    // With max_pending > 0, submit() blocks while that many jobs are queued, which
+    // bounds the memory held by images waiting for the disk.
+    async_image_writer(size_t max_pending = 0)
+      : max_pending(max_pending), worker([this] { run(); }) {}
+
+    ~async_image_writer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    async_image_writer(const async_image_writer&) = delete;
+    async_image_writer& operator=(const async_image_writer&) = delete;
+
+    void submit(const std::string& path, image_buffer img) {
+        submit(path, [path, img = std::move(img)] { return image_io::write_image(path, img); });
+    }
+
+    // Queues any writer; `path` identifies the output for coalescing and error messages.
+    void submit(const std::string& path, std::function<bool()> write) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            // A newer image for a path supersedes one still waiting to be written.
+            for (auto& j : jobs) {
+                if (j.path == path) {
+                    j.write = std::move(write);
+                    return;
+                }
+            }
+            if (max_pending > 0)
+                idle.wait(lock, [this] { return jobs.size() < max_pending; });
+            jobs.push_back({path, std::move(write)});
+        }
+        wake.notify_all();
+    }
+
+    // Blocks until every submitted image is on disk.
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return jobs.empty() && !busy; });
+    }
+
+  private:
+    struct job {
+        std::string path;
+        std::function<bool()> write;
+    };
+
+    size_t max_pending;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::deque<job> jobs;
+    bool busy = false;
+    bool stopping = false;
+    std::thread worker;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+
+            auto j = std::move(jobs.front());
+            jobs.pop_front();
+            busy = true;
+            idle.notify_all();
+            lock.unlock();
+
+            if (!j.write())
+                std::clog << "\nFailed to write " << j.path << "\n";
+
+            lock.lock();
+            busy = false;
+            idle.notify_all();
+        }
+    }
+};
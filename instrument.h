@@ -0,0 +1,80 @@
+#pragma once
+
+#include <mutex>
+
+// Work counters for finding where render time goes. They only exist when compiled with
+// RT_INSTRUMENT defined (the zsw_one_instrumented target); otherwise RT_COUNT expands to
+// nothing and the renderer carries no counting code at all.
+class ray_counters {
+  public:
+    unsigned long long node_visits = 0;     // BVH nodes whose box was tested
+    unsigned long long primitive_tests = 0; // Sphere and quad intersection tests
+    unsigned long long primitive_hits = 0;  // ...of which found a closer hit
+    unsigned long long paths = 0;           // Camera rays
+    unsigned long long bounces = 0;         // Scattering events along all paths
+    unsigned long long light_samples = 0;   // Points drawn on the lights
+    unsigned long long shadow_rays = 0;     // ...and rays traced toward them
+    unsigned long long texture_fetches = 0; // texture::value() calls
+
+    ray_counters& operator+=(const ray_counters& o) {
+        node_visits += o.node_visits;
+        primitive_tests += o.primitive_tests;
+        primitive_hits += o.primitive_hits;
+        paths += o.paths;
+        bounces += o.bounces;
+        light_samples += o.light_samples;
+        shadow_rays += o.shadow_rays;
+        texture_fetches += o.texture_fetches;
+        return *this;
+    }
+
+    // The traversal work summed into the per pixel cost heatmap.
+    unsigned long long traversal_work() const { return node_visits + primitive_tests; }
+};
+
+namespace instrument {
+
+#ifdef RT_INSTRUMENT
+constexpr bool enabled = true;
+#else
+constexpr bool enabled = false;
+#endif
+
+// This thread's counts since its last merge().
+inline thread_local ray_counters local;
+
+inline std::mutex& merge_mutex() {
+    static std::mutex m;
+    return m;
+}
+
+inline ray_counters& merged() {
+    static ray_counters total;
+    return total;
+}
+
+// Adds this thread's counts to the shared total and zeroes them. Every thread that
+// traced rays calls this once its work is done.
+inline void merge() {
+    std::lock_guard<std::mutex> lock(merge_mutex());
+    merged() += local;
+    local = ray_counters();
+}
+
+// Returns the shared total and starts a new one.
+inline ray_counters take_merged() {
+    std::lock_guard<std::mutex> lock(merge_mutex());
+    auto total = merged();
+    merged() = ray_counters();
+    return total;
+}
+
+} // namespace instrument
+
+#ifdef RT_INSTRUMENT
+#define RT_COUNT(counter) (++instrument::local.counter)
+#define RT_COUNT_N(counter, n) (instrument::local.counter += (n))
+#else
+#define RT_COUNT(counter) ((void)0)
+#define RT_COUNT_N(counter, n) ((void)0)
+#endif
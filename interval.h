@@ -4,35 +4,38 @@
 
 class interval {
   public:
-    double min, max;
+    real min, max;
 
     interval() : min(+infinity), max(-infinity) {} // Default interval is empty
 
-    interval(double _min, double _max) : min(_min), max(_max) {}
+    interval(real _min, real _max) : min(_min), max(_max) {}
 
-    bool contains(double x) const {
+    bool contains(real x) const {
         return min <= x && x <= max;
     }
 
-    bool surrounds(double x) const {
+    bool surrounds(real x) const {
         return min < x && x < max;
     }
 
-    double clamp(double x) const {
+    real clamp(real x) const {
         if(x < min) return min;
         else if(x > max) return max;
         return x;
     }
 
-    interval expand(double delta)
+    interval expand(real delta)
     {
         return interval(min - 0.5 * delta, max + 0.5 * delta);
     }    
 
-    double size()
+    real size()
     {
         return max - min;
     }
 
     static const interval empty, universe;
 };
+
+inline const interval interval::empty   (+infinity, -infinity);
+inline const interval interval::universe(-infinity, +infinity);
@@ -0,0 +1,184 @@
+#pragma once
+
+#include "hittable_list.h"
+#include "rtweekend.h"
+
+#include <unordered_map>
+#include <vector>
+
+class alias_table {
+  public:
+    alias_table() = default;
+
+    alias_table(const std::vector<double>& weights) {
+        // Vose's alias method: split the distribution into n equally likely bins, each
+        // holding at most two outcomes, so that sampling is a single lookup.
+        auto n = weights.size();
+        pmfs.resize(n);
+        probs.resize(n);
+        aliases.resize(n);
+        if (n == 0) return;
+
+        auto total = 0.0;
+        for (auto w : weights)
+            total += w;
+
+        std::vector<double> scaled(n);
+        std::vector<size_t> small, large;
+        for (size_t i = 0; i < n; i++) {
+            pmfs[i] = (total > 0) ? weights[i] / total : 1.0 / n;
+            scaled[i] = pmfs[i] * n;
+            if (scaled[i] < 1.0) small.push_back(i);
+            else large.push_back(i);
+        }
+
+        while (!small.empty() && !large.empty()) {
+            auto s = small.back(); small.pop_back();
+            auto l = large.back(); large.pop_back();
+
+            probs[s] = scaled[s];
+            aliases[s] = l;
+
+            scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+            if (scaled[l] < 1.0) small.push_back(l);
+            else large.push_back(l);
+        }
+
+        // Whatever is left is 1 up to round-off.
+        for (auto l : large) { probs[l] = 1.0; aliases[l] = l; }
+        for (auto s : small) { probs[s] = 1.0; aliases[s] = s; }
+    }
+
+    size_t sample(double u) const {
+        double remapped;
+        return sample(u, remapped);
+    }
+
+    // Also returns u rescaled to a fresh uniform number in [0,1), for the caller's next
+    // decision, so one sampler dimension serves both.
+    size_t sample(double u, double& remapped) const {
+        // Map a uniform number in [0,1) to an index; the integer part picks the bin and the
+        // fractional part decides between the bin and its alias.
+        auto n = probs.size();
+        auto scaled = u * n;
+        auto i = std::min(static_cast<size_t>(scaled), n - 1);
+        auto frac = scaled - i;
+        if (frac < probs[i]) {
+            remapped = frac / probs[i];
+            return i;
+        }
+        remapped = (frac - probs[i]) / (1 - probs[i]);
+        return aliases[i];
+    }
+
+    double pmf(size_t i) const { return pmfs[i]; }
+
+    size_t size() const { return pmfs.size(); }
+
+  private:
+    std::vector<double> pmfs;
+    std::vector<double> probs;
+    std::vector<size_t> aliases;
+};
+
+class light_sampler : public hittable {
+  public:
+    // Builds the selection table once per scene. Lights are picked with probability
+    // proportional to emitted power times area. Objects that do not emit (such as a glass
+    // sphere added to guide caustic rays) get the mean emitter weight so they stay sampled.
+    light_sampler(const hittable_list& lights) : objects(lights.objects) {
+        std::vector<double> weights;
+        auto emitter_sum = 0.0;
+        int emitters = 0;
+        for (size_t i = 0; i < objects.size(); i++) {
+            const auto& object = objects[i];
+            index[object.get()] = i;
+            auto power = object->emitted_power();
+            weights.push_back(power);
+            bbox.merge(object->bounding_box());
+            if (power > 0) {
+                emitter_sum += power;
+                emitters++;
+            }
+        }
+
+        auto fallback = emitters > 0 ? emitter_sum / emitters : 1.0;
+        for (auto& w : weights)
+            if (w <= 0) w = fallback;
+
+        table = alias_table(weights);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        bool hit_anything = false;
+        for (const auto& object : objects) {
+            if (object->hit(r, ray_t, rec)) {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
+        }
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    double pdf_value(const point3& origin, const vec3& v) const override {
+        // The direction may point at any light, so the solid angle density is a sum.
+        return pdf_except(origin, v, objects.size());
+    }
+
+    vec3 random(const vec3& origin) const override {
+        if (objects.empty())
+            return vec3(0,0,0);
+        return objects[table.sample(random_double())]->random(origin);
+    }
+
+    bool sample(const point3& origin, double u1, double u2, light_sample& ls) const override {
+        if (objects.empty())
+            return false;
+        double u;
+        auto i = table.sample(u1, u);
+        if (!objects[i]->sample(origin, u, u2, ls))
+            return false;
+
+        ls.pdf = table.pmf(i) * ls.pdf + pdf_except(origin, ls.p - origin, i);
+        return ls.pdf > 0;
+    }
+
+    double hit_pdf_value(const point3& origin, const vec3& v, const hit_record& rec) const override {
+        // The same sum as pdf_value(), with the term of the light that was hit, found
+        // through an O(1) lookup, evaluated from the hit rather than by intersecting it.
+        auto found = index.find(rec.object);
+        if (found == index.end())
+            return pdf_except(origin, v, objects.size());
+        auto i = found->second;
+        return table.pmf(i) * rec.object->hit_pdf_value(origin, v, rec) + pdf_except(origin, v, i);
+    }
+
+    double emitted_power() const override {
+        auto sum = 0.0;
+        for (const auto& object : objects)
+            sum += object->emitted_power();
+        return sum;
+    }
+
+    double pmf(size_t i) const { return table.pmf(i); }
+
+  private:
+    // Density of direction v over every light but light `skip`. A light's density is
+    // zero unless v passes through it, so lights whose box the ray misses are skipped
+    // without evaluating them; with a single light there is nothing to do.
+    double pdf_except(const point3& origin, const vec3& v, size_t skip) const {
+        auto sum = 0.0;
+        ray r(origin, v);
+        for (size_t i = 0; i < objects.size(); i++)
+            if (i != skip && objects[i]->bounding_box().hit(r, interval(0.001, infinity)))
+                sum += table.pmf(i) * objects[i]->pdf_value(origin, v);
+        return sum;
+    }
+
+    std::vector<shared_ptr<hittable>> objects;
+    alias_table table;
+    std::unordered_map<const hittable*, size_t> index;
+    aabb bbox{interval::empty, interval::empty, interval::empty};
+};
@@ -9,13 +9,96 @@
 #include "texture.h"
 #include "quad.h"
 #include "constant_medium.h"
+#include "light_sampler.h"
+#include "perf_counters.h"
 #include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <string>
 
 using namespace std;
 
-const interval interval::empty   (+infinity, -infinity);
-const interval interval::universe(-infinity, +infinity);
+// Command line options applied to the camera of whichever scene is rendered.
+struct render_options {
+    bool resume = false;
+    double checkpoint_interval = 0;
+    std::string sampler = "independent";
+    bool ray_packets = true;
+    bool wavefront = false;
+
+    // Render modes; each overrides the scene's own setting only when given.
+    bool adaptive = false;
+    double time_budget = 0;
+    bool denoise = false;
+    std::string aov_path;
+    std::string stream_path;
+
+    // Benchmark mode: each scene at a fixed width, spp and seed, images to
+    // output/bench/<scene>.pfm and references to reference/<scene>.pfm.
+    bool bench = false;
+    bool update_reference = false;
+    int bench_width = 160;
+    int bench_spp = 16;
+    int reference_spp = 1024;
+    uint64_t seed = 1;
+    std::string scene;  // Scene being benchmarked
+    render_stats stats; // Of the last render
+};
+
+static render_options options;
+
+void render_scene(camera& cam, const hittable& world, const hittable* lights) {
+    cam.resume = options.resume;
+    cam.checkpoint_interval = options.checkpoint_interval;
+    cam.ray_packets = options.ray_packets;
+    cam.wavefront = options.wavefront;
+    if (options.adaptive)
+        cam.adaptive = true;
+    if (options.time_budget > 0)
+        cam.time_budget = options.time_budget;
+    if (options.denoise)
+        cam.denoise = true;
+    if (!options.aov_path.empty())
+        cam.aov_path = options.aov_path;
+    if (!options.stream_path.empty())
+        cam.stream_path = options.stream_path;
+    if (options.bench) {
+        cam.image_width = options.bench_width;
+        cam.samples_per_pixel = options.update_reference ? options.reference_spp : options.bench_spp;
+        cam.output_path = (options.update_reference ? "reference/" : "output/bench/")
+                        + options.scene + ".pfm";
+        cam.adaptive = false;
+        cam.time_budget = 0;
+        cam.checkpoint_interval = 0;
+        cam.resume = false;
+        cam.denoise = false;
+        cam.aov_path.clear();
+        cam.stream_path.clear();
+    }
+    using kind = pattern_sampler::kind;
+    if (options.sampler == "sobol")
+        cam.pixel_sampler = make_shared<sobol_sampler>();
+    else if (options.sampler == "bluenoise")
+        cam.pixel_sampler = make_shared<blue_noise_sampler>();
+    else if (options.sampler == "stratified")
+        cam.pixel_sampler = make_shared<pattern_sampler>(kind::stratified, cam.samples_per_pixel);
+    else if (options.sampler == "lhs")
+        cam.pixel_sampler = make_shared<pattern_sampler>(kind::latin_hypercube, cam.samples_per_pixel);
+    else if (options.sampler == "cmj")
+        cam.pixel_sampler =
+            make_shared<pattern_sampler>(kind::correlated_multi_jittered, cam.samples_per_pixel);
+    cam.render(world, lights);
+    options.stats = cam.stats();
+}
+
+// Builds the scene BVH, counted as its own phase under --perf.
+shared_ptr<bvh_node> build_bvh(const hittable_list& world) {
+    perf::phase build("bvh_build");
+    return make_shared<bvh_node>(world);
+}
 
 void earth() {
     auto earth_texture = make_shared<image_texture>("earthmap.jpg");
@@ -35,7 +118,7 @@ void earth() {
 
     cam.defocus_angle = 0;
 
-    cam.render(hittable_list(globe), nullptr);
+    render_scene(cam, hittable_list(globe), nullptr);
 }
 
 void many_balls()
@@ -58,7 +141,7 @@ void many_balls()
                     // diffuse
                     auto albedo = color::random() * color::random();
                     sphere_material = make_shared<lambertian>(albedo);
-                    vec3 speed{0, random_double()*40, 0};
+                    vec3 speed(0, random_double()*40, 0);
                     world.add(make_shared<sphere>(center, 0.2, sphere_material, speed));
                 } else if (choose_mat < 0.95) {
                     // metal
@@ -84,7 +167,7 @@ void many_balls()
     auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
     world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
 
-    auto world2 = std::make_shared<bvh_node>(world);
+    auto world2 = build_bvh(world);
 
     camera cam;
     
@@ -100,7 +183,7 @@ void many_balls()
     cam.defocus_angle = 0.6;
     cam.focus_dist    = 10.0;
 
-    cam.render(*world2, nullptr);    
+    render_scene(cam, *world2, nullptr);    
 }
 
 
@@ -152,7 +235,7 @@ void random_spheres() {
     auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
     world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
 
-    auto world2 = make_shared<bvh_node>(world);
+    auto world2 = build_bvh(world);
 
     camera cam;
 
@@ -170,7 +253,7 @@ void random_spheres() {
     cam.defocus_angle = 0.6;
     cam.focus_dist    = 10.0;
 
-    cam.render(*world2, nullptr);
+    render_scene(cam, *world2, nullptr);
 }
 
 void simple_light()
@@ -201,7 +284,7 @@ void simple_light()
 
     cam.defocus_angle = 0;
 
-    cam.render(world, light.get());
+    render_scene(cam, world, light.get());
 }
 
 void cornell_box() {
@@ -256,7 +339,8 @@ void cornell_box() {
     hittable_list sample_hittables;
     sample_hittables.add(quad_light);
     sample_hittables.add(glass_sphere);
-    cam.render(world, &sample_hittables);
+    light_sampler lights(sample_hittables);
+    render_scene(cam, world, &lights);
 }
 
 
@@ -302,11 +386,156 @@ void cornell_smoke() {
     cam.lookat(point3(278, 278, 0), vec3(0,1,0));
     cam.defocus_angle = 0;
 
-    cam.render(world, quad_light.get());
+    render_scene(cam, world, quad_light.get());
 }
 
-int main()
+struct scene_entry {
+    const char* name;
+    void (*render)();
+};
+
+static const scene_entry scenes[] = {
+    {"earth", earth},
+    {"many_balls", many_balls},
+    {"random_spheres", random_spheres},
+    {"simple_light", simple_light},
+    {"cornell_box", cornell_box},
+    {"cornell_smoke", cornell_smoke},
+};
+
+// Renders every scene from the same seed and writes one JSON record per scene with
+// ray counts, throughput, BVH nodes per ray and light samples per path (RT_INSTRUMENT
+// builds only, else null) and the RMSE against its reference image (null when there is
+// none; create them with --update-reference). With --perf each record also has the
+// hardware counts per phase.
+int run_benchmarks(const std::string& json_path) {
+    std::filesystem::create_directories("output/bench");
+    std::filesystem::create_directories("reference");
+
+    auto number = [](double v) {
+        std::ostringstream out;
+        if (std::isfinite(v)) out << v;
+        else out << "null";
+        return out.str();
+    };
+
+    std::ostringstream json;
+    json << "{\n  \"width\": " << options.bench_width
+         << ",\n  \"spp\": " << (options.update_reference ? options.reference_spp : options.bench_spp)
+         << ",\n  \"seed\": " << options.seed
+         << ",\n  \"sampler\": \"" << options.sampler << "\""
+         << ",\n  \"scalar\": \"" << (sizeof(real) == sizeof(float) ? "float" : "double") << "\""
+         << ",\n  \"ray_packets\": " << (options.ray_packets ? "true" : "false")
+         << ",\n  \"integrator\": \"" << (options.wavefront ? "wavefront" : "recursive") << "\""
+         << ",\n  \"scenes\": [";
+
+    bool first = true;
+    for (const auto& s : scenes) {
+        std::clog << "Benchmarking " << s.name << '\n';
+        options.scene = s.name;
+        rng() = pcg32(options.seed);
+        s.render();
+        const auto& st = options.stats;
+
+        double error = std::nan("");
+        image_buffer image, reference;
+        if (!options.update_reference
+            && image_io::read_pfm("output/bench/" + options.scene + ".pfm", image)
+            && image_io::read_pfm("reference/" + options.scene + ".pfm", reference)
+            && image.width() == reference.width() && image.height() == reference.height())
+            error = image_io::rmse(image, reference);
+
+        json << (first ? "" : ",") << "\n    {\"name\": \"" << s.name << "\""
+             << ", \"primary_rays\": " << st.primary_rays
+             << ", \"total_rays\": " << st.rays
+             << ", \"seconds\": " << number(st.seconds)
+             << ", \"rays_per_second\": " << number(st.rays / st.seconds)
+             << ", \"bvh_nodes_per_ray\": "
+             << number(instrument::enabled ? double(st.counters.node_visits) / st.rays : NAN)
+             << ", \"light_samples_per_path\": "
+             << number(instrument::enabled
+                       ? double(st.counters.light_samples) / st.counters.paths : NAN)
+             << ", \"rmse\": " << number(error);
+        if (!st.perf.empty()) {
+            json << ", \"perf\": {";
+            for (size_t p = 0; p < st.perf.size(); ++p) {
+                json << (p ? ", " : "") << "\"" << st.perf[p].name << "\": {";
+                for (int k = 0; k < perf::counter_values::count; ++k)
+                    json << (k ? ", " : "") << "\"" << perf::counter_values::name(k)
+                         << "\": " << number(st.perf[p].values.v[k]);
+                json << "}";
+            }
+            json << "}";
+        }
+        json << "}";
+        first = false;
+    }
+    json << "\n  ]\n}\n";
+
+    std::cout << json.str();
+    std::ofstream out(json_path);
+    out << json.str();
+    if (!out) {
+        std::cerr << "Failed to write " << json_path << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
 {
+    std::string bench_out = "output/bench.json";
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--resume") {
+            options.resume = true;
+        } else if (arg == "--checkpoint" && i + 1 < argc) {
+            options.checkpoint_interval = std::atof(argv[++i]);
+        } else if (arg == "--sampler" && i + 1 < argc) {
+            options.sampler = argv[++i];
+        } else if (arg == "--bench") {
+            options.bench = true;
+        } else if (arg == "--bench-out" && i + 1 < argc) {
+            bench_out = argv[++i];
+        } else if (arg == "--bench-spp" && i + 1 < argc) {
+            options.bench_spp = std::atoi(argv[++i]);
+        } else if (arg == "--bench-width" && i + 1 < argc) {
+            options.bench_width = std::atoi(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            options.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--wavefront") {
+            options.wavefront = true;
+        } else if (arg == "--adaptive") {
+            options.adaptive = true;
+        } else if (arg == "--time-budget" && i + 1 < argc) {
+            options.time_budget = std::atof(argv[++i]);
+        } else if (arg == "--denoise") {
+            options.denoise = true;
+        } else if (arg == "--aov" && i + 1 < argc) {
+            options.aov_path = argv[++i];
+        } else if (arg == "--stream" && i + 1 < argc) {
+            options.stream_path = argv[++i];
+        } else if (arg == "--no-packets") {
+            options.ray_packets = false;
+        } else if (arg == "--perf") {
+            perf::enable();
+        } else if (arg == "--update-reference") {
+            options.bench = true;
+            options.update_reference = true;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--checkpoint seconds] [--resume] [--perf] [--no-packets] [--wavefront]"
+                      << " [--sampler independent|sobol|bluenoise|stratified|lhs|cmj]\n"
+                      << "       " << argv[0] << " [--adaptive] [--time-budget seconds] [--denoise]"
+                      << " [--aov file.exr] [--stream file.exr]\n"
+                      << "       " << argv[0] << " --bench [--bench-out file.json]"
+                      << " [--bench-spp N] [--bench-width N] [--seed N] [--update-reference]\n";
+            return 1;
+        }
+    }
+
+    if (options.bench)
+        return run_benchmarks(bench_out);
+
     //earth();
     //cornell_box();
     //cornell_smoke();
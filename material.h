@@ -5,64 +5,80 @@
 #include "color.h"
 #include "texture.h"
 #include "pdf.h"
+#include "sampler.h"
 
 class hit_record;
 class ray;
 
+// The concrete material classes below, for integrators that group hits by material
+// class and shade each group with non-virtual calls. Materials defined elsewhere are
+// `other` and always go through the virtual functions.
+enum class material_type { lambertian, metal, dielectric, diffuse_light, isotropic, other };
+constexpr int material_type_count = 6;
+
 class material
 {
 public:
+    explicit material(material_type type = material_type::other) : type(type) {}
     virtual ~material() = default;
+
+    const material_type type;
+
     virtual color emitted(double u, double v, const point3 &p) const
     {
         return color(0,0,0);
     }
     
-    virtual bool scatter(const ray &in, const std::shared_ptr<pdf> &sample_pdf, const hit_record &rec, color &attenuation, ray &scattered) const = 0;
+    virtual bool scatter(const ray &in, const hit_record &rec, color &attenuation, ray &scattered, sampler &smp) const = 0;
+
+    // Surface color used for the albedo AOV.
+    virtual color albedo_value(const hit_record &rec) const
+    {
+        return color(0,0,0);
+    }
 
     virtual double scattering_pdf(const ray &r_in, const hit_record &rec,
                           const ray &scattered)
     const {
         return 0;    
     }
+
+    // BSDF times cosine for light leaving along `scattered`. Materials whose scatter()
+    // draws directions with density scattering_pdf() implement both, and the camera then
+    // samples the lights at their hits too; for the others it is never called.
+    virtual color scattering_value(const ray &r_in, const hit_record &rec,
+                                   const ray &scattered) const
+    {
+        return color(0,0,0);
+    }
 };
 
-class lambertian : public material
+class lambertian final : public material
 {
 public:
-    lambertian(const std::shared_ptr<texture> &a) : albedo(a) {}
-    lambertian(const color &a) : albedo(std::make_shared<solid_color>(a)) {}
+    lambertian(const std::shared_ptr<texture> &a) : material(material_type::lambertian), albedo(a) {}
+    lambertian(const color &a) : material(material_type::lambertian), albedo(std::make_shared<solid_color>(a)) {}
+    color albedo_value(const hit_record &rec) const override
+    {
+        return albedo->value(rec.u, rec.v, rec.p);
+    }
     double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered)
     const override {
         auto cos_theta = dot(rec.normal, unit_vector(scattered.direction()));
         return cos_theta < 0 ? 0 : cos_theta/pi;
-    }    
-    bool scatter(const ray &in, const std::shared_ptr<pdf> &sample_pdf, const hit_record &rec, color &attenuation, ray &scattered) const override
+    }
+    color scattering_value(const ray& r_in, const hit_record& rec, const ray& scattered)
+    const override {
+        return albedo->value(rec.u, rec.v, rec.p) * scattering_pdf(r_in, rec, scattered);
+    }
+    bool scatter(const ray &in, const hit_record &rec, color &attenuation, ray &scattered, sampler &smp) const override
     {
-        auto scatter_direction = rec.normal + random_unit_vector();
+        auto [u1, u2] = smp.get_2d();
+        auto scatter_direction = rec.normal + sample_unit_vector(u1, u2);
         if(scatter_direction.near_zero())
             scatter_direction = rec.normal;
         scattered = ray(rec.p, scatter_direction, in.time());
         attenuation = albedo->value(rec.u, rec.v, rec.p);
-
-        // auto scatter_direction = sample_pdf->generate();
-        // double pdf_value = sample_pdf->value(scatter_direction);
-
-        // // if(pdf_value <= 0.0)
-        // // {
-        // //     std::cout << "negative attenuation" << std::endl;
-        // //     auto aa = sample_pdf->value(scatter_direction);
-        // // }
-
-        
-        // scattered = ray(rec.p, scatter_direction, in.time());
-        // double spdf = scattering_pdf(in, rec, scattered);
-        // attenuation = albedo->value(rec.u, rec.v, rec.p) * spdf/pdf_value;
-            
-        // assert(attenuation.x() >= 0.0 && attenuation.y() >= 0.0 &&
-        //        attenuation.z() >= 0.0);
-        // assert(attenuation.x() < 1.0 && attenuation.y() < 1.0 &&
-        //        attenuation.z() < 1.0);
         return true;
     }
 
@@ -70,14 +86,16 @@ private:
     std::shared_ptr<texture> albedo;
 };
 
-class metal : public material
+class metal final : public material
 {
 public:
-    metal(const color &a, const double f) : albedo(a), fuzz(std::clamp(f, 0.0, 1.0)) {}
-    bool scatter(const ray &in, const std::shared_ptr<pdf> &sample_pdf, const hit_record &rec, color &attenuation, ray &scattered) const override
+    metal(const color &a, const double f) : material(material_type::metal), albedo(a), fuzz(std::clamp(f, 0.0, 1.0)) {}
+    color albedo_value(const hit_record &rec) const override { return albedo; }
+    bool scatter(const ray &in, const hit_record &rec, color &attenuation, ray &scattered, sampler &smp) const override
     {
         auto reflect_direction = reflect(unit_vector(in.direction()), rec.normal);
-        reflect_direction = unit_vector(reflect_direction) + fuzz * random_unit_vector();
+        auto [u1, u2] = smp.get_2d();
+        reflect_direction = unit_vector(reflect_direction) + fuzz * sample_unit_vector(u1, u2);
         attenuation = albedo;
         scattered = ray(rec.p, reflect_direction, in.time());
         return dot(scattered.direction(), rec.normal) > 0;
@@ -88,11 +106,12 @@ private:
     double fuzz;
 };
 
-class dielectric : public material
+class dielectric final : public material
 {
 public:
-    dielectric(const double ri) : reflection_index(ri) {}
-    bool scatter(const ray &in, const std::shared_ptr<pdf> &sample_pdf, const hit_record &rec, color &attenuation, ray &scattered) const override
+    dielectric(const double ri) : material(material_type::dielectric), reflection_index(ri) {}
+    color albedo_value(const hit_record &rec) const override { return color(1,1,1); }
+    bool scatter(const ray &in, const hit_record &rec, color &attenuation, ray &scattered, sampler &smp) const override
     {
         attenuation = color(1.0, 1.0, 1.0);
         vec3 uin_dir = unit_vector(in.direction());
@@ -102,7 +121,7 @@ public:
         double ct = fabs(dot(uin_dir, rec.normal));
         double st = sqrt(1-ct*ct);
         bool cannot_recract = st * ir > 1;
-        if(cannot_recract || random_double() < reflectance(ct, ir))
+        if(cannot_recract || smp.get_1d() < reflectance(ct, ir))
         {
             vec3 dir = reflect(uin_dir, rec.normal);
             scattered = ray(rec.p, dir, in.time());
@@ -123,18 +142,22 @@ private:
     }    
 };
 
-class diffuse_light : public material
+class diffuse_light final : public material
 {
 public:
-    diffuse_light(std::shared_ptr<texture> &a) : albedo(a) {}
+    diffuse_light(std::shared_ptr<texture> &a) : material(material_type::diffuse_light), albedo(a) {}
 
-    diffuse_light(const color &a) : albedo(std::make_shared<solid_color>(a)) {}
+    diffuse_light(const color &a) : material(material_type::diffuse_light), albedo(std::make_shared<solid_color>(a)) {}
 
     color emitted(double u, double v, const point3 &p) const override
     {
         return albedo->value(u, v, p);
     }
-    bool scatter(const ray &in, const std::shared_ptr<pdf> &sample_pdf, const hit_record &rec, color &attenuation, ray &scattered) const override
+    color albedo_value(const hit_record &rec) const override
+    {
+        return albedo->value(rec.u, rec.v, rec.p);
+    }
+    bool scatter(const ray &in, const hit_record &rec, color &attenuation, ray &scattered, sampler &smp) const override
     {
         return false;
     }
@@ -142,14 +165,19 @@ private:
     std::shared_ptr<texture> albedo;
 };
 
-class isotropic : public material {
+class isotropic final : public material {
   public:
-    isotropic(color c) : albedo(make_shared<solid_color>(c)) {}
-    isotropic(shared_ptr<texture> a) : albedo(a) {}
+    isotropic(color c) : material(material_type::isotropic), albedo(make_shared<solid_color>(c)) {}
+    isotropic(shared_ptr<texture> a) : material(material_type::isotropic), albedo(a) {}
 
-    bool scatter(const ray& r_in, const std::shared_ptr<pdf> &sample_pdf, const hit_record& rec, color& attenuation, ray& scattered)
-    const override {
-        scattered = ray(rec.p, random_unit_vector(), r_in.time());
+    color albedo_value(const hit_record& rec) const override {
+        return albedo->value(rec.u, rec.v, rec.p);
+    }
+
+    bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered,
+                 sampler& smp) const override {
+        auto [u1, u2] = smp.get_2d();
+        scattered = ray(rec.p, sample_unit_vector(u1, u2), r_in.time());
         attenuation = albedo->value(rec.u, rec.v, rec.p);
         return true;
     }
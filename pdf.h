@@ -4,6 +4,7 @@
 #include "vec3.h"
 #include "onb.h"
 #include "hittable.h"
+#include "instrument.h"
 
 class pdf {
 public:
@@ -78,9 +79,20 @@ class hittable_pdf : public pdf {
       return obj->pdf_value(origin, direction);
     }
 
+    // Density of a direction whose hit on the scene is already known.
+    double value(const vec3 &direction, const hit_record &rec) const {
+      return obj->hit_pdf_value(origin, direction, rec);
+    }
+
     vec3 generate() const override {
+      RT_COUNT(light_samples);
       return obj->random(origin);
     }
+
+    bool generate(double u1, double u2, light_sample &ls) const {
+      RT_COUNT(light_samples);
+      return obj->sample(origin, u1, u2, ls);
+    }
   private:
     const hittable * obj;
     point3 origin;
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware event counts per render phase (BVH build, render, output) from Linux
+// perf_event, off unless perf::enable() is called. Events the kernel or CPU refuses,
+// and every event on other systems, read as NaN.
+namespace perf {
+
+class counter_values {
+  public:
+    static constexpr int count = 5;
+    double v[count] = {NAN, NAN, NAN, NAN, NAN};
+
+    static const char* name(int k) {
+        static const char* names[count] = {
+            "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+        };
+        return names[k];
+    }
+
+    counter_values& operator+=(const counter_values& o) {
+        for (int k = 0; k < count; ++k)
+            v[k] = std::isnan(v[k]) ? o.v[k] : v[k] + (std::isnan(o.v[k]) ? 0 : o.v[k]);
+        return *this;
+    }
+
+    counter_values operator-(const counter_values& o) const {
+        counter_values d;
+        for (int k = 0; k < count; ++k)
+            d.v[k] = v[k] - o.v[k];
+        return d;
+    }
+};
+
+class event_set {
+  // One counter per event, user space only, for the calling thread and the threads it
+  // creates afterwards (inherit): a child's counts join the total when it exits, so the
+  // image writer's work lands in the phase that joins it.
+  public:
+    event_set() {
+#if defined(__linux__)
+        const std::pair<uint32_t, uint64_t> events[counter_values::count] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                                 | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        };
+        for (int k = 0; k < counter_values::count; ++k) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = events[k].first;
+            attr.config = events[k].second;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.inherit = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[k] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+#endif
+    }
+
+    ~event_set() {
+#if defined(__linux__)
+        for (auto fd : fds)
+            if (fd >= 0) close(fd);
+#endif
+    }
+
+    event_set(const event_set&) = delete;
+    event_set& operator=(const event_set&) = delete;
+
+    bool any() const {
+        for (auto fd : fds)
+            if (fd >= 0) return true;
+        return false;
+    }
+
+    // Counts since the events were opened, scaled up when the kernel multiplexed them.
+    counter_values read() const {
+        counter_values c;
+#if defined(__linux__)
+        for (int k = 0; k < counter_values::count; ++k) {
+            uint64_t buf[3]; // value, time enabled, time running
+            if (fds[k] < 0 || ::read(fds[k], buf, sizeof(buf)) != ssize_t(sizeof(buf)))
+                continue;
+            c.v[k] = buf[2] ? double(buf[0]) * double(buf[1]) / double(buf[2]) : 0.0;
+        }
+#endif
+        return c;
+    }
+
+  private:
+    int fds[counter_values::count] = {-1, -1, -1, -1, -1};
+};
+
+class phase_total {
+  public:
+    std::string name;
+    counter_values values;
+};
+
+inline bool& enabled_flag() {
+    static bool on = false;
+    return on;
+}
+
+inline bool enabled() { return enabled_flag(); }
+
+inline const event_set& events() {
+    static const event_set set;
+    return set;
+}
+
+// Opens the counters. Call it before any thread that should be counted is started.
+inline bool enable() {
+    enabled_flag() = true;
+    if (!events().any())
+        std::clog << "No perf_event counters: no hardware PMU, or perf_event_paranoid forbids it\n";
+    return events().any();
+}
+
+inline std::vector<phase_total>& totals() {
+    static std::vector<phase_total> t;
+    return t;
+}
+
+// Returns the per phase totals and starts over.
+inline std::vector<phase_total> take_totals() {
+    auto t = std::move(totals());
+    totals().clear();
+    return t;
+}
+
+// Adds the events counted during its lifetime to the named phase.
+class phase {
+  public:
+    explicit phase(const char* name) : name(name) {
+        if (enabled()) start = events().read();
+    }
+
+    ~phase() {
+        if (!enabled()) return;
+        auto delta = events().read() - start;
+        for (auto& t : totals())
+            if (t.name == name) {
+                t.values += delta;
+                return;
+            }
+        totals().push_back({name, delta});
+    }
+
+    phase(const phase&) = delete;
+    phase& operator=(const phase&) = delete;
+
+  private:
+    const char* name;
+    counter_values start;
+};
+
+// Prints each phase's counts, and per ray figures when rays > 0.
+inline void report(std::ostream& out, const std::vector<phase_total>& phases,
+                   unsigned long long rays) {
+    auto precision = out.precision(4);
+    out << std::setw(12) << "phase";
+    for (int k = 0; k < counter_values::count; ++k)
+        out << std::setw(16) << counter_values::name(k);
+    out << '\n';
+    for (const auto& p : phases) {
+        out << std::setw(12) << p.name;
+        for (auto v : p.values.v)
+            out << std::setw(16) << v;
+        out << '\n';
+        if (rays == 0) continue;
+        out << std::setw(12) << "  per ray";
+        for (auto v : p.values.v)
+            out << std::setw(16) << v / double(rays);
+        out << '\n';
+    }
+    out.precision(precision);
+}
+
+} // namespace perf
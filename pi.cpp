@@ -1,29 +1,209 @@
 #include "rtweekend.h"
+#include "sampler.h"
 
-#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+// Estimates pi as four times the fraction of [0,1)^2 inside the unit quarter circle, to
+// compare point generators on throughput (samples/s over 1..N threads) and convergence
+// (RMS error of the estimate over independent seeds as N grows).
+
+enum class generator { plain, stratified, sobol, blue_noise };
+
+static const char* name(generator g) {
+    switch (g) {
+      case generator::plain: return "plain";
+      case generator::stratified: return "stratified";
+      case generator::sobol: return "sobol";
+      case generator::blue_noise: return "bluenoise";
+    }
+    return "";
+}
+
+// Writes points [first, first + count) of an n point set into xs and ys. Every
+// generator is addressed by index, so threads can each fill a slice of one point set.
+class point_source {
+  public:
+    point_source(generator g, uint64_t n, uint32_t seed)
+      : kind(g), seed(seed), hashed_seed(sobol_detail::hash(seed)), plain_rng(seed, 0),
+        sobol(seed), blue_noise(seed)
+    {
+        grid = std::max<uint64_t>(1, uint64_t(std::sqrt(double(n))));
+        while (grid * grid > n) --grid;
+        while ((grid + 1) * (grid + 1) <= n) ++grid;
+    }
 
-int main() {
-    int inside_circle = 0;
-    int inside_circle_stratified = 0;
-    int sqrt_N = 1000;
-    for (int i = 0; i < sqrt_N; i++) {
-        for (int j = 0; j < sqrt_N; j++) {
-            auto x = random_double(-1,1);
-            auto y = random_double(-1,1);
-            if (x*x + y*y < 1)
-                inside_circle++;
-            x = 2*((i + random_double()) / sqrt_N) - 1;
-            y = 2*((j + random_double()) / sqrt_N) - 1;
-            if (x*x + y*y < 1)
-                inside_circle_stratified++;
+    void fill(uint64_t first, int count, double* xs, double* ys) {
+        switch (kind) {
+          case generator::plain:
+            if (first != plain_next) {
+                // Each slice gets its own stream.
+                plain_rng = pcg32(seed, first + 1);
+            }
+            for (int k = 0; k < count; ++k) {
+                xs[k] = plain_rng.next() / 4294967296.0;
+                ys[k] = plain_rng.next() / 4294967296.0;
+            }
+            plain_next = first + count;
+            break;
+
+          case generator::stratified:
+            // Jittered grid over the largest square that fits; any remainder is random.
+            for (int k = 0; k < count; ++k) {
+                auto s = first + k;
+                if (s < grid * grid) {
+                    xs[k] = (s % grid + pattern_detail::jitter(uint32_t(s), hashed_seed)) / grid;
+                    ys[k] = (s / grid + pattern_detail::jitter(uint32_t(s), ~hashed_seed)) / grid;
+                } else {
+                    xs[k] = pattern_detail::jitter(uint32_t(s), hashed_seed ^ 0x9e3779b9u);
+                    ys[k] = pattern_detail::jitter(uint32_t(s), ~hashed_seed ^ 0x9e3779b9u);
+                }
+            }
+            break;
+
+          case generator::sobol:
+            for (int k = 0; k < count; ++k) {
+                sobol.start_pixel_sample(0, 0, int(first + k));
+                std::tie(xs[k], ys[k]) = sobol.get_2d();
+            }
+            break;
+
+          case generator::blue_noise:
+            // Consecutive points go to consecutive pixels of the blue noise tile.
+            for (int k = 0; k < count; ++k) {
+                auto s = first + k;
+                auto pixel = int(s % (blue_noise_tile::size * blue_noise_tile::size));
+                blue_noise.start_pixel_sample(pixel % blue_noise_tile::size,
+                                              pixel / blue_noise_tile::size,
+                                              int(s / (blue_noise_tile::size * blue_noise_tile::size)));
+                std::tie(xs[k], ys[k]) = blue_noise.get_2d();
+            }
+            break;
         }
     }
 
-    std::cout << std::fixed << std::setprecision(12);
-    std::cout
-        << "Regular    Estimate of Pi = "
-        << (4.0 * inside_circle) / (sqrt_N*sqrt_N) << '\n'
-        << "Stratified Estimate of Pi = "
-        << (4.0 * inside_circle_stratified) / (sqrt_N*sqrt_N) << '\n';
-}
\ No newline at end of file
+  private:
+    generator kind;
+    uint32_t seed;
+    uint32_t hashed_seed;
+    uint64_t grid;
+    pcg32 plain_rng;
+    uint64_t plain_next = ~uint64_t(0);
+    sobol_sampler sobol;
+    blue_noise_sampler blue_noise;
+};
+
+static constexpr int batch = 256;
+
+// Points in the quarter circle among [first, last). Points are made a batch at a time
+// into flat arrays, so the test itself is a branch free loop the compiler vectorizes.
+static uint64_t count_inside(point_source& src, uint64_t first, uint64_t last) {
+    alignas(64) double xs[batch], ys[batch];
+    uint64_t inside = 0;
+    for (auto s = first; s < last; s += batch) {
+        int count = int(std::min<uint64_t>(batch, last - s));
+        src.fill(s, count, xs, ys);
+        int hits = 0;
+        for (int k = 0; k < count; ++k)
+            hits += (xs[k] * xs[k] + ys[k] * ys[k] < 1.0);
+        inside += hits;
+    }
+    return inside;
+}
+
+static double estimate(generator g, uint64_t n, uint32_t seed, int threads) {
+    std::vector<uint64_t> inside(threads, 0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+        workers.emplace_back([&, t] {
+            point_source src(g, n, seed);
+            inside[t] = count_inside(src, n * t / threads, n * (t + 1) / threads);
+        });
+    for (auto& w : workers)
+        w.join();
+
+    uint64_t total = 0;
+    for (auto c : inside)
+        total += c;
+    return 4.0 * total / n;
+}
+
+int main(int argc, char** argv) {
+    int max_threads = int(std::max(1u, std::thread::hardware_concurrency()));
+    uint64_t throughput_samples = uint64_t(1) << 24;
+    int max_log4_n = 10;
+    int seeds = 16;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--threads") && i + 1 < argc)
+            max_threads = std::max(1, std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--samples") && i + 1 < argc)
+            throughput_samples = std::max(1LL, std::atoll(argv[++i]));
+        else if (!std::strcmp(argv[i], "--max-log4-n") && i + 1 < argc)
+            max_log4_n = std::max(1, std::atoi(argv[++i]));
+        else if (!std::strcmp(argv[i], "--seeds") && i + 1 < argc)
+            seeds = std::max(1, std::atoi(argv[++i]));
+        else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--threads N] [--samples N] [--max-log4-n K] [--seeds S]\n";
+            return 1;
+        }
+    }
+
+    const generator generators[] = {
+        generator::plain, generator::stratified, generator::sobol, generator::blue_noise
+    };
+
+    std::vector<int> thread_counts;
+    for (int t = 1; t < max_threads; t *= 2)
+        thread_counts.push_back(t);
+    thread_counts.push_back(max_threads);
+
+    // Point sets are built once up front, so the timings below leave it out.
+    blue_noise_tile::get();
+
+    std::cout << "Throughput, " << throughput_samples << " samples\n"
+              << std::setw(12) << "generator" << std::setw(9) << "threads"
+              << std::setw(14) << "Msamples/s" << std::setw(16) << "estimate\n";
+    for (auto g : generators) {
+        for (int t : thread_counts) {
+            auto start = std::chrono::steady_clock::now();
+            auto pi_hat = estimate(g, throughput_samples, 0, t);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << std::setw(12) << name(g) << std::setw(9) << t
+                      << std::setw(14) << std::fixed << std::setprecision(1)
+                      << throughput_samples / elapsed.count() / 1e6
+                      << std::setw(15) << std::setprecision(8) << pi_hat << '\n';
+        }
+    }
+
+    // Not rtweekend's pi: its 8 digits are off by about 5e-8, below which the QMC
+    // errors fall at large N.
+    const double exact_pi = std::acos(-1.0);
+    std::cout << "\nConvergence, RMS error over " << seeds << " seeds\n"
+              << std::setw(10) << "N";
+    for (auto g : generators)
+        std::cout << std::setw(14) << name(g);
+    std::cout << '\n' << std::scientific << std::setprecision(3);
+    for (int k = 1; k <= max_log4_n; ++k) {
+        uint64_t n = uint64_t(1) << (2 * k);
+        std::cout << std::setw(10) << n;
+        for (auto g : generators) {
+            double sum_sq = 0;
+            for (int s = 0; s < seeds; ++s) {
+                auto err = estimate(g, n, uint32_t(s + 1), max_threads) - exact_pi;
+                sum_sq += err * err;
+            }
+            std::cout << std::setw(14) << std::sqrt(sum_sq / seeds);
+        }
+        std::cout << '\n';
+    }
+}
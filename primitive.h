@@ -0,0 +1,189 @@
+#pragma once
+
+#include "hittable.h"
+#include "quad.h"
+#include "sphere.h"
+#include "triangle.h"
+
+#include <memory>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+class primitive;
+
+// A chain of translate and rotate_y wrappers collapsed into one rigid motion around its
+// children: a world point p is p_object = R (p - offset) in their space, with R the
+// rotation by theta about y.
+class instance {
+  public:
+    real sin_theta = 0, cos_theta = 1;
+    vec3 offset{0, 0, 0};
+    aabb bbox;
+    std::shared_ptr<const std::vector<primitive>> children;
+
+    // Folds in the motion of a wrapper nested inside the ones folded in so far.
+    void translate_by(const vec3& d) { offset += to_world(d); }
+
+    void rotate_by(real s, real c) {
+        auto s0 = sin_theta;
+        sin_theta = s * cos_theta + c * s0;
+        cos_theta = c * cos_theta - s * s0;
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const;
+
+    aabb bounding_box() const { return bbox; }
+
+  private:
+    // The rotation, and its inverse, the same arithmetic rotate_y does.
+    vec3 to_object(const vec3& v) const {
+        return vec3(cos_theta*v[0] - sin_theta*v[2], v[1], sin_theta*v[0] + cos_theta*v[2]);
+    }
+
+    vec3 to_world(const vec3& v) const {
+        return vec3(cos_theta*v[0] + sin_theta*v[2], v[1], -sin_theta*v[0] + cos_theta*v[2]);
+    }
+};
+
+// One primitive of the closed set that BVH leaves store by value. Intersecting it is a
+// switch on the variant index followed by a direct, inlinable call, where a hittable
+// costs a virtual call per wrapper. Objects outside the set stay behind their hittable
+// interface, as the last alternative.
+class primitive {
+  public:
+    using shape = std::variant<sphere, quad, cuboid, triangle, instance, std::shared_ptr<hittable>>;
+
+    shape value;
+    // The object the primitive was copied from. Hits report it as rec.object, so that
+    // light sampling still recognizes its lights.
+    std::shared_ptr<hittable> source;
+
+    primitive(shape value, std::shared_ptr<hittable> source)
+      : value(std::move(value)), source(std::move(source)) {}
+
+    // Closest hit search without the hit record: on a hit inside ray_t, fills `hit` with
+    // what complete() needs. Instances and objects behind hittable cannot defer; they
+    // write rec in full instead and leave hit.deferred false.
+    bool intersect(const ray& r, interval ray_t, surface_hit& hit, hit_record& rec) const {
+        switch (value.index()) {
+        case 0: return intersect_shape(*std::get_if<0>(&value), r, ray_t, hit, rec);
+        case 1: return intersect_shape(*std::get_if<1>(&value), r, ray_t, hit, rec);
+        case 2: return intersect_shape(*std::get_if<2>(&value), r, ray_t, hit, rec);
+        case 3: return intersect_shape(*std::get_if<3>(&value), r, ray_t, hit, rec);
+        case 4: return intersect_shape(*std::get_if<4>(&value), r, ray_t, hit, rec);
+        default: return intersect_shape(*std::get_if<5>(&value), r, ray_t, hit, rec);
+        }
+    }
+
+    // The full hit record of a hit that intersect() deferred.
+    void complete(const ray& r, const surface_hit& hit, hit_record& rec) const {
+        switch (value.index()) {
+        case 0: std::get_if<0>(&value)->complete(r, hit, rec); break;
+        case 1: std::get_if<1>(&value)->complete(r, hit, rec); break;
+        case 2: std::get_if<2>(&value)->complete(r, hit, rec); break;
+        case 3: std::get_if<3>(&value)->complete(r, hit, rec); break;
+        default: return;
+        }
+        rec.object = source.get();
+    }
+
+    // Defers the lanes it can, like intersect(); the BVH completes them at the end.
+    void hit_packet(const ray_packet& rays, packet_hits& hits, unsigned mask) const {
+        std::visit([&](const auto& s) {
+            using T = std::decay_t<decltype(s)>;
+            if constexpr (std::is_same_v<T, std::shared_ptr<hittable>>) {
+                s->hit_packet(rays, hits, mask);
+            } else if constexpr (std::is_same_v<T, sphere>) {
+                real t[ray_packet::size];
+                auto found = s.intersect_packet(rays, hits.t, mask, t);
+                for (int k = 0; k < ray_packet::size; ++k)
+                    if (found >> k & 1)
+                        hits.defer(k, deferred_hit(t[k], 0, 0));
+            } else if constexpr (std::is_same_v<T, quad>) {
+                real t[ray_packet::size], a[ray_packet::size], b[ray_packet::size];
+                auto found = s.intersect_packet(rays, hits.t, mask, t, a, b);
+                for (int k = 0; k < ray_packet::size; ++k)
+                    if (found >> k & 1)
+                        hits.defer(k, deferred_hit(t[k], a[k], b[k]));
+            } else {
+                for (int k = 0; k < ray_packet::size; ++k) {
+                    surface_hit h;
+                    hit_record rec;
+                    if (!(mask >> k & 1)
+                        || !intersect_shape(s, rays.get(k), interval(rays.t_min, hits.t[k]), h, rec))
+                        continue;
+                    if (h.deferred)
+                        hits.defer(k, h);
+                    else
+                        hits.set(k, rec);
+                }
+            }
+        }, value);
+    }
+
+    aabb bounding_box() const {
+        return std::visit([](const auto& s) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(s)>, std::shared_ptr<hittable>>)
+                return s->bounding_box();
+            else
+                return s.bounding_box();
+        }, value);
+    }
+
+  private:
+    template <typename T>
+    bool intersect_shape(const T& s, const ray& r, interval ray_t, surface_hit& hit,
+                         hit_record& rec) const {
+        if constexpr (std::is_same_v<T, std::shared_ptr<hittable>> || std::is_same_v<T, instance>) {
+            bool found;
+            if constexpr (std::is_same_v<T, instance>)
+                found = s.hit(r, ray_t, rec); // Reports the child that was hit
+            else
+                found = s->hit(r, ray_t, rec);
+            if (!found)
+                return false;
+            hit.t = rec.t;
+            hit.deferred = false;
+            return true;
+        } else {
+            if (!s.intersect(r, ray_t, hit))
+                return false;
+            hit.prim = this;
+            hit.deferred = true;
+            return true;
+        }
+    }
+
+    surface_hit deferred_hit(real t, real a, real b) const {
+        surface_hit h;
+        h.t = t;
+        h.a = a;
+        h.b = b;
+        h.prim = this;
+        h.deferred = true;
+        return h;
+    }
+};
+
+inline bool instance::hit(const ray& r, interval ray_t, hit_record& rec) const {
+    ray object_r(to_object(r.origin() - offset), to_object(r.direction()), r.time());
+
+    surface_hit closest;
+    bool hit_anything = false;
+    for (const auto& child : *children) {
+        if (child.intersect(object_r, ray_t, closest, rec)) {
+            hit_anything = true;
+            ray_t.max = closest.t;
+        }
+    }
+    if (!hit_anything)
+        return false;
+
+    if (closest.deferred)
+        closest.prim->complete(object_r, closest, rec);
+
+    rec.p = to_world(rec.p) + offset;
+    rec.normal = to_world(rec.normal);
+    return true;
+}
@@ -3,8 +3,10 @@
 #include "hittable_list.h"
 #include "vec3.h"
 #include "aabb.h"
+#include "instrument.h"
+#include "material.h"
 
-class quad : public hittable {
+class quad final : public hittable {
   public:
     quad(const point3& _Q, const vec3& _u, const vec3& _v, std::shared_ptr<material> m)
       : Q(_Q), u(_u), v(_v), mat(m)
@@ -14,20 +16,34 @@ class quad : public hittable {
         D = dot(normal, Q);
         w = n / dot(n,n);
         area = n.length();
+        alpha_axis = cross(v, w);
+        beta_axis = cross(w, u);
         set_bounding_box();
     }
 
-    virtual void set_bounding_box() {
-        bbox = aabb(Q, Q + u + v).pad();
+    void set_bounding_box() {
+        // Both diagonals: one alone misses corners when u and v have mixed signs.
+        bbox = aabb(aabb(Q, Q + u + v), aabb(Q + u, Q + v)).pad();
     }
 
     aabb bounding_box() const override { return bbox; }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        surface_hit h;
+        if (!intersect(r, ray_t, h))
+            return false;
+        complete(r, h, rec);
+        return true;
+    }
+
+    // The distance and plane coordinate tests alone; complete() builds the hit record
+    // from their result.
+    bool intersect(const ray& r, interval ray_t, surface_hit& h) const {
+        RT_COUNT(primitive_tests);
         auto denom = dot(normal, r.direction());
 
         // No hit if the ray is parallel to the plane.
-        if (fabs(denom) < 1e-8)
+        if (std::fabs(denom) < real(1e-8))
             return false;
 
         // Return false if the hit point parameter t is outside the ray interval.
@@ -41,37 +57,114 @@ class quad : public hittable {
         auto alpha = dot(w, cross(planar_hitpt_vector, v));
         auto beta = dot(w, cross(u, planar_hitpt_vector));
 
-        if (!is_interior(alpha, beta, rec))
+        if (!is_interior(alpha, beta))
             return false;
 
-        // Ray hits the 2D shape; set the rest of the hit record and return true.
-        rec.t = t;
-        rec.p = intersection;
-        rec.mat = mat;
-        rec.set_face_normal(r, normal);
+        h.t = t;
+        h.a = alpha;
+        h.b = beta;
+        RT_COUNT(primitive_hits);
+        return true;
+    }
 
+    bool intersect(const ray& r, interval ray_t, surface_hit& h, hit_record&) const override {
+        if (!intersect(r, ray_t, h))
+            return false;
+        h.deferred = true;
         return true;
     }
 
-    virtual bool is_interior(double a, double b, hit_record& rec) const {
-        // Given the hit point in plane coordinates, return false if it is outside the
-        // primitive, otherwise set the hit record UV coordinates and return true.
+    void complete(const ray& r, const surface_hit& h, hit_record& rec) const override {
+        set_hit(r, h.t, r.at(h.t), h.a, h.b, rec);
+    }
 
-        if ((a < 0) || (1 < a) || (b < 0) || (1 < b))
-            return false;
+    void hit_packet(const ray_packet& rays, packet_hits& hits, unsigned mask) const override {
+        real ts[ray_packet::size], alphas[ray_packet::size], betas[ray_packet::size];
+        auto found = intersect_packet(rays, hits.t, mask, ts, alphas, betas);
+        for (int k = 0; k < ray_packet::size; ++k) {
+            if (!(found >> k & 1))
+                continue;
+            auto r = rays.get(k);
+            set_hit(r, ts[k], r.at(ts[k]), alphas[k], betas[k], hits.rec[k]);
+            hits.mark(k);
+        }
+    }
 
-        rec.u = a;
-        rec.v = b;
-        return true;
+    void intersect_packet(const ray_packet& rays, packet_hits& hits, unsigned mask) const override {
+        real ts[ray_packet::size], alphas[ray_packet::size], betas[ray_packet::size];
+        auto found = intersect_packet(rays, hits.t, mask, ts, alphas, betas);
+        for (int k = 0; k < ray_packet::size; ++k) {
+            if (!(found >> k & 1))
+                continue;
+            surface_hit h;
+            h.t = ts[k];
+            h.a = alphas[k];
+            h.b = betas[k];
+            h.deferred = true;
+            hits.defer(k, h, this);
+        }
+    }
+
+    // intersect() for every lane of mask at once: the lanes whose ray hits closer than
+    // t_max[lane], with their distances and plane coordinates. w . (p x v) and
+    // w . (u x p) are rewritten as p . (v x w) and p . (w x u) with both axes
+    // precomputed.
+    unsigned intersect_packet(const ray_packet& rays, const real* t_max, unsigned mask,
+                              real* ts, real* alphas, real* betas) const {
+        RT_COUNT_N(primitive_tests, __builtin_popcount(mask));
+        unsigned found = 0;
+        for (int k = 0; k < ray_packet::size; ++k) {
+            auto denom = normal.x() * rays.dx[k] + normal.y() * rays.dy[k] + normal.z() * rays.dz[k];
+            auto t = (D - (normal.x() * rays.ox[k] + normal.y() * rays.oy[k]
+                           + normal.z() * rays.oz[k])) / denom;
+            auto px = rays.ox[k] + t * rays.dx[k] - Q.x();
+            auto py = rays.oy[k] + t * rays.dy[k] - Q.y();
+            auto pz = rays.oz[k] + t * rays.dz[k] - Q.z();
+            ts[k] = t;
+            alphas[k] = px * alpha_axis.x() + py * alpha_axis.y() + pz * alpha_axis.z();
+            betas[k] = px * beta_axis.x() + py * beta_axis.y() + pz * beta_axis.z();
+            found |= unsigned(std::fabs(denom) >= real(1e-8) && rays.t_min <= t
+                              && t <= t_max[k] && is_interior(alphas[k], betas[k])) << k;
+        }
+
+        found &= mask;
+        RT_COUNT_N(primitive_hits, __builtin_popcount(found));
+        return found;
+    }
+
+    // Whether the hit point, in plane coordinates, lies inside the quad.
+    static bool is_interior(real a, real b) {
+        return !((a < 0) || (1 < a) || (b < 0) || (1 < b));
     }
 
     double pdf_value(const point3& origin, const vec3 &dir) const override {
-        hit_record rec;
-        if (!this->hit(ray(origin, dir), interval(0.001, infinity), rec))
+        // Analytic ray-plane test; no hit_record or material reference is touched.
+        auto denom = dot(normal, dir);
+        if (std::fabs(denom) < real(1e-8))
+            return 0;
+
+        auto t = (D - dot(normal, origin)) / denom;
+        if (t < 0.001)
+            return 0;
+
+        vec3 planar_hitpt_vector = origin + t * dir - Q;
+        auto alpha = dot(w, cross(planar_hitpt_vector, v));
+        auto beta = dot(w, cross(u, planar_hitpt_vector));
+        if ((alpha < 0) || (1 < alpha) || (beta < 0) || (1 < beta))
+            return 0;
+
+        auto distance_squared = t * t * dir.length_squared();
+        auto cosine = std::fabs(denom) / dir.length();
+
+        return distance_squared / (cosine * area);
+    }
+
+    double hit_pdf_value(const point3& origin, const vec3 &dir, const hit_record &rec) const override {
+        if (rec.object != this)
             return 0;
 
         auto distance_squared = rec.t * rec.t * dir.length_squared();
-        auto cosine = fabs(dot(dir, rec.normal) / dir.length());
+        auto cosine = std::fabs(dot(dir, normal) / dir.length());
 
         return distance_squared / (cosine * area);
     }
@@ -80,38 +173,201 @@ class quad : public hittable {
         auto random_point = Q + random_double() * u + random_double() * v;
         return random_point - origin;
     }
+
+    bool sample(const point3 &origin, double u1, double u2, light_sample &ls) const override {
+        ls.p = Q + u1 * u + u2 * v;
+        ls.normal = normal;
+
+        auto to_light = ls.p - origin;
+        auto distance_squared = to_light.length_squared();
+        ls.distance = std::sqrt(distance_squared);
+
+        auto cosine = std::fabs(dot(to_light, normal)) / ls.distance;
+        if (cosine < real(1e-8))
+            return false;
+
+        ls.pdf = distance_squared / (cosine * area);
+        return true;
+    }
+
+    double emitted_power() const override {
+        auto centroid = Q + 0.5 * (u + v);
+        return luminance(mat->emitted(0.5, 0.5, centroid)) * area;
+    }
   private:
+    void set_hit(const ray& r, real t, const point3& p, real a, real b, hit_record& rec) const {
+        rec.t = t;
+        rec.p = p;
+        rec.u = a;
+        rec.v = b;
+        rec.mat = mat;
+        rec.object = this;
+        rec.set_face_normal(r, normal);
+    }
+
     point3 Q;
     vec3 u, v;
     std::shared_ptr<material> mat;
     aabb bbox;
     vec3 normal;
-    double D;
-    double area;
+    real D;
+    real area;
     vec3 w;
+    vec3 alpha_axis, beta_axis; // v x w and w x u, for the packet test
 };
 
 
-inline std::shared_ptr<hittable_list> box(const point3& a, const point3& b, std::shared_ptr<material> mat)
-{
-    // Returns the 3D box (six sides) that contains the two opposite vertices a & b.
+// Axis aligned box, intersected with one slab test rather than as six quads. Each face
+// reports the normal and (u, v) that the matching quad of box() used to.
+class cuboid final : public hittable {
+  public:
+    cuboid(const point3& a, const point3& b, std::shared_ptr<material> m)
+      : lo(min(a, b)), hi(max(a, b)), mat(m), bbox(aabb(a, b).pad())
+    {
+        // The six sides as quads, for sampling the box as a light. A flat box keeps
+        // only the two sides with area, which coincide.
+        auto dx = vec3(hi.x() - lo.x(), 0, 0);
+        auto dy = vec3(0, hi.y() - lo.y(), 0);
+        auto dz = vec3(0, 0, hi.z() - lo.z());
+        auto add_face = [&](const point3& q, const vec3& u, const vec3& v) {
+            if (cross(u, v).length_squared() > 0)
+                faces.add(std::make_shared<quad>(q, u, v, mat));
+        };
+        add_face(point3(lo.x(), lo.y(), hi.z()),  dx,  dy); // front
+        add_face(point3(hi.x(), lo.y(), hi.z()), -dz,  dy); // right
+        add_face(point3(hi.x(), lo.y(), lo.z()), -dx,  dy); // back
+        add_face(point3(lo.x(), lo.y(), lo.z()),  dz,  dy); // left
+        add_face(point3(lo.x(), hi.y(), hi.z()),  dx, -dz); // top
+        add_face(point3(lo.x(), lo.y(), lo.z()),  dx,  dz); // bottom
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        surface_hit h;
+        if (!intersect(r, ray_t, h))
+            return false;
+        complete(r, h, rec);
+        return true;
+    }
+
+    // The slab test alone; complete() builds the hit record from its result.
+    bool intersect(const ray& r, interval ray_t, surface_hit& h) const {
+        RT_COUNT(primitive_tests);
+        real enter, leave;
+        int enter_axis, leave_axis;
+        if (!slabs(r, enter, leave, enter_axis, leave_axis))
+            return false;
 
-    auto sides = std::make_shared<hittable_list>();
+        // The entry face, or the exit face for a ray that starts inside.
+        if (ray_t.contains(enter))
+            h.t = enter;
+        else if (ray_t.contains(leave))
+            h.t = leave;
+        else
+            return false;
+        RT_COUNT(primitive_hits);
+        return true;
+    }
 
-    // Construct the two opposite vertices with the minimum and maximum coordinates.
-    auto min = point3(fmin(a.x(), b.x()), fmin(a.y(), b.y()), fmin(a.z(), b.z()));
-    auto max = point3(fmax(a.x(), b.x()), fmax(a.y(), b.y()), fmax(a.z(), b.z()));
+    bool intersect(const ray& r, interval ray_t, surface_hit& h, hit_record&) const override {
+        if (!intersect(r, ray_t, h))
+            return false;
+        h.deferred = true;
+        return true;
+    }
 
-    auto dx = vec3(max.x() - min.x(), 0, 0);
-    auto dy = vec3(0, max.y() - min.y(), 0);
-    auto dz = vec3(0, 0, max.z() - min.z());
+    void complete(const ray& r, const surface_hit& h, hit_record& rec) const override {
+        // Which face was hit is not kept; the slab test is cheap enough to repeat.
+        real enter, leave;
+        int enter_axis, leave_axis;
+        slabs(r, enter, leave, enter_axis, leave_axis);
+        bool entering = h.t == enter;
+        auto axis = entering ? enter_axis : leave_axis;
 
-    sides->add(std::make_shared<quad>(point3(min.x(), min.y(), max.z()),  dx,  dy, mat)); // front
-    sides->add(std::make_shared<quad>(point3(max.x(), min.y(), max.z()), -dz,  dy, mat)); // right
-    sides->add(std::make_shared<quad>(point3(max.x(), min.y(), min.z()), -dx,  dy, mat)); // back
-    sides->add(std::make_shared<quad>(point3(min.x(), min.y(), min.z()),  dz,  dy, mat)); // left
-    sides->add(std::make_shared<quad>(point3(min.x(), max.y(), max.z()),  dx, -dz, mat)); // top
-    sides->add(std::make_shared<quad>(point3(min.x(), min.y(), min.z()),  dx,  dz, mat)); // bottom
+        rec.t = h.t;
+        rec.p = r.at(rec.t);
+        set_face_uv(axis, (r.direction()[axis] < 0) == entering, rec);
+        rec.mat = mat;
+        rec.object = this;
 
-    return sides;
-}
\ No newline at end of file
+        vec3 outward_normal(0, 0, 0);
+        outward_normal[axis] = (r.direction()[axis] < 0) == entering ? 1 : -1;
+        rec.set_face_normal(r, outward_normal);
+    }
+
+    // As a light the box is its six sides, each picked with equal probability.
+    double pdf_value(const point3& origin, const vec3& dir) const override {
+        return faces.pdf_value(origin, dir);
+    }
+
+    double hit_pdf_value(const point3& origin, const vec3& dir, const hit_record& rec) const override {
+        if (rec.object != this)
+            return 0.0;
+        return faces.pdf_value(origin, dir);
+    }
+
+    vec3 random(const vec3& origin) const override {
+        return faces.random(origin);
+    }
+
+    bool sample(const point3& origin, double u1, double u2, light_sample& ls) const override {
+        return faces.sample(origin, u1, u2, ls);
+    }
+
+    double emitted_power() const override {
+        return faces.emitted_power();
+    }
+
+  private:
+    // Where the ray enters and leaves the slabs, and through which axis. False if the
+    // line misses the box.
+    bool slabs(const ray& r, real& enter, real& leave, int& enter_axis, int& leave_axis) const {
+        enter = -infinity;
+        leave = infinity;
+        enter_axis = leave_axis = 0;
+        for (int a = 0; a < 3; ++a) {
+            auto inv = 1 / r.direction()[a];
+            auto t0 = (lo[a] - r.origin()[a]) * inv;
+            auto t1 = (hi[a] - r.origin()[a]) * inv;
+            if (inv < 0)
+                std::swap(t0, t1);
+            if (t0 > enter) { enter = t0; enter_axis = a; }
+            if (t1 < leave) { leave = t1; leave_axis = a; }
+        }
+        return enter <= leave;
+    }
+
+    // (u, v) of rec.p on the face of `axis` at its max side (or min side), laid out
+    // as the corresponding quad of the six-sided box.
+    void set_face_uv(int axis, bool max_side, hit_record& rec) const {
+        // A flat box has no extent along one axis; its coordinate there is 0.
+        auto size = hi - lo;
+        auto fraction = [&](int a) {
+            return size[a] > 0 ? (rec.p[a] - lo[a]) / size[a] : real(0);
+        };
+        auto fx = fraction(0), fy = fraction(1), fz = fraction(2);
+        if (axis == 0) {        // right, left
+            rec.u = max_side ? 1 - fz : fz;
+            rec.v = fy;
+        } else if (axis == 1) { // top, bottom
+            rec.u = fx;
+            rec.v = max_side ? 1 - fz : fz;
+        } else {                // front, back
+            rec.u = max_side ? fx : 1 - fx;
+            rec.v = fy;
+        }
+    }
+
+    point3 lo, hi;
+    std::shared_ptr<material> mat;
+    aabb bbox;
+    hittable_list faces;
+};
+
+
+inline std::shared_ptr<cuboid> box(const point3& a, const point3& b, std::shared_ptr<material> mat)
+{
+    // Returns the 3D box (six sides) that contains the two opposite vertices a & b.
+    return std::make_shared<cuboid>(a, b, mat);
+}
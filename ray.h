@@ -8,18 +8,18 @@ class ray {
 
     ray(const point3& origin, const vec3& direction) : orig(origin), dir(direction), tm(0) {}
 
-    ray(const point3& origin, const vec3& direction, double time) : orig(origin), dir(direction), tm(time) {}
+    ray(const point3& origin, const vec3& direction, real time) : orig(origin), dir(direction), tm(time) {}
 
     point3 origin() const  { return orig; }
     vec3 direction() const { return dir; }
-    double time() const { return tm; }
+    real time() const { return tm; }
 
-    point3 at(double t) const {
+    point3 at(real t) const {
         return orig + t*dir;
     }
 
   private:
     point3 orig;
     vec3 dir;
-    double tm;
+    real tm;
 };
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "aabb.h"
+#include "interval.h"
+#include "ray.h"
+
+#include <algorithm>
+
+// Up to `size` rays traced together, stored as one array per component so the per lane
+// loops of the packet kernels vectorize. Lane k is live when bit k of a mask is set.
+// Besides the rays themselves the packet keeps interval bounds over all of its rays,
+// which let a BVH node be rejected for the whole packet with a single test.
+class ray_packet {
+  public:
+    static constexpr int size = 8;
+    static constexpr unsigned all = (1u << size) - 1;
+
+    int count = 0;
+    real t_min = 0.001;
+    real ox[size], oy[size], oz[size];
+    real dx[size], dy[size], dz[size];
+    real inv_dx[size], inv_dy[size], inv_dz[size];
+    real time[size];
+
+    // Bounds of the origins and inverse directions over the packet, valid for culling
+    // only when `coherent`, i.e. every ray's direction has the same signs.
+    real o_lo[3], o_hi[3];
+    real inv_lo[3], inv_hi[3];
+    bool coherent = false;
+
+    void add(const ray& r) {
+        auto o = r.origin(), d = r.direction();
+        auto inv = reciprocal(d);
+        ox[count] = o.x(); oy[count] = o.y(); oz[count] = o.z();
+        dx[count] = d.x(); dy[count] = d.y(); dz[count] = d.z();
+        inv_dx[count] = inv.x(); inv_dy[count] = inv.y(); inv_dz[count] = inv.z();
+        time[count] = r.time();
+        ++count;
+    }
+
+    // Pads the unused lanes with copies of lane 0, so full width loops stay valid, and
+    // computes the packet bounds.
+    void finish() {
+        for (int k = count; k < size; ++k) {
+            ox[k] = ox[0]; oy[k] = oy[0]; oz[k] = oz[0];
+            dx[k] = dx[0]; dy[k] = dy[0]; dz[k] = dz[0];
+            inv_dx[k] = inv_dx[0]; inv_dy[k] = inv_dy[0]; inv_dz[k] = inv_dz[0];
+            time[k] = time[0];
+        }
+
+        const real* o[3] = {ox, oy, oz};
+        const real* inv[3] = {inv_dx, inv_dy, inv_dz};
+        coherent = true;
+        for (int a = 0; a < 3; ++a) {
+            o_lo[a] = *std::min_element(o[a], o[a] + size);
+            o_hi[a] = *std::max_element(o[a], o[a] + size);
+            inv_lo[a] = *std::min_element(inv[a], inv[a] + size);
+            inv_hi[a] = *std::max_element(inv[a], inv[a] + size);
+            coherent = coherent && (inv_lo[a] > 0 || inv_hi[a] < 0);
+        }
+    }
+
+    unsigned lanes() const { return (1u << count) - 1; }
+
+    ray get(int k) const {
+        return ray(point3(ox[k], oy[k], oz[k]), vec3(dx[k], dy[k], dz[k]), time[k]);
+    }
+};
+
+// Lanes of `mask` whose ray enters box before t_max[lane], the lane's closest hit so
+// far: the same slab test as aabb::hit, branch free over all lanes.
+inline unsigned packet_box_hit(const aabb& box, const ray_packet& rays, const real* t_max,
+                               unsigned mask) {
+    // Interval arithmetic first: with every direction in one octant, the entry and exit
+    // distances of all rays lie within intervals computed from the packet bounds. If
+    // even the most favourable of them miss the box, no ray can hit it.
+    if (rays.coherent) {
+        real t_far_max = rays.t_min;
+        for (int k = 0; k < ray_packet::size; ++k)
+            if (mask >> k & 1) t_far_max = std::max(t_far_max, t_max[k]);
+
+        real enter = rays.t_min, leave = t_far_max;
+        for (int a = 0; a < 3; ++a) {
+            const auto& slab = box.axis(a);
+            bool positive = rays.inv_lo[a] > 0;
+            auto near_plane = positive ? slab.min : slab.max;
+            auto far_plane = positive ? slab.max : slab.min;
+            // Lowest possible entry and highest possible exit over all rays.
+            auto n0 = (near_plane - rays.o_lo[a]), n1 = (near_plane - rays.o_hi[a]);
+            auto f0 = (far_plane - rays.o_lo[a]), f1 = (far_plane - rays.o_hi[a]);
+            auto lo = std::min({n0 * rays.inv_lo[a], n0 * rays.inv_hi[a],
+                                n1 * rays.inv_lo[a], n1 * rays.inv_hi[a]});
+            auto hi = std::max({f0 * rays.inv_lo[a], f0 * rays.inv_hi[a],
+                                f1 * rays.inv_lo[a], f1 * rays.inv_hi[a]});
+            enter = std::max(enter, lo);
+            leave = std::min(leave, hi);
+        }
+        if (leave <= enter)
+            return 0;
+    }
+
+    unsigned hit = 0;
+    for (int k = 0; k < ray_packet::size; ++k) {
+        auto x0 = (box.x.min - rays.ox[k]) * rays.inv_dx[k];
+        auto x1 = (box.x.max - rays.ox[k]) * rays.inv_dx[k];
+        auto y0 = (box.y.min - rays.oy[k]) * rays.inv_dy[k];
+        auto y1 = (box.y.max - rays.oy[k]) * rays.inv_dy[k];
+        auto z0 = (box.z.min - rays.oz[k]) * rays.inv_dz[k];
+        auto z1 = (box.z.max - rays.oz[k]) * rays.inv_dz[k];
+        // Near and far planes by direction sign, as aabb::hit does, so that an empty box
+        // (min > max) is missed rather than spanning everything.
+        auto enter = std::max({rays.inv_dx[k] < 0 ? x1 : x0, rays.inv_dy[k] < 0 ? y1 : y0,
+                               rays.inv_dz[k] < 0 ? z1 : z0, rays.t_min});
+        auto leave = std::min({rays.inv_dx[k] < 0 ? x0 : x1, rays.inv_dy[k] < 0 ? y0 : y1,
+                               rays.inv_dz[k] < 0 ? z0 : z1, t_max[k]});
+        hit |= unsigned(enter < leave) << k;
+    }
+    return hit & mask;
+}
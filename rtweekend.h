@@ -1,13 +1,69 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <iostream>
 #include <limits>
 #include <memory>
 
+// Scalar type of vec3, ray, interval, aabb and the primitives' geometry. Building with
+// RT_USE_FLOAT halves their size; probabilities, pdfs and the framebuffer's per pixel
+// sums stay double.
+#ifdef RT_USE_FLOAT
+using real = float;
+#else
+using real = double;
+#endif
+
 constexpr double infinity = std::numeric_limits<double>::infinity();
 constexpr double pi = 3.1415926;
 
+// Random Number Generation
+
+class pcg32 {
+  // Minimal PCG32 (O'Neill, pcg-random.org). Unlike rand(), its whole state is two
+  // integers, so renders can save and restore it exactly.
+  public:
+    uint64_t state = 0x853c49e6748fea9bULL;
+    uint64_t inc = 0xda3e39cb94b95bdbULL;
+
+    pcg32() = default;
+
+    pcg32(uint64_t seed, uint64_t sequence = 1) {
+        state = 0;
+        inc = (sequence << 1u) | 1u;
+        next();
+        state += seed;
+        next();
+    }
+
+    uint32_t next() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+        uint32_t rot = static_cast<uint32_t>(old >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+    void save(std::ostream& out) const {
+        out.write(reinterpret_cast<const char*>(&state), sizeof(state));
+        out.write(reinterpret_cast<const char*>(&inc), sizeof(inc));
+    }
+
+    bool load(std::istream& in) {
+        in.read(reinterpret_cast<char*>(&state), sizeof(state));
+        in.read(reinterpret_cast<char*>(&inc), sizeof(inc));
+        return bool(in);
+    }
+};
+
+inline pcg32& rng() {
+    // The generator behind random_double() and random_int().
+    static pcg32 generator;
+    return generator;
+}
+
 // Utility Functions
 
 inline double degrees_to_radians(double degrees) {
@@ -16,7 +72,7 @@ inline double degrees_to_radians(double degrees) {
 
 inline double random_double() {
     // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0);
+    return rng().next() / 4294967296.0;
 }
 
 inline double random_double(double min, double max) {
@@ -26,5 +82,5 @@ inline double random_double(double min, double max) {
 
 inline int random_int(int min, int max)
 {
-    return rand()%(max-min+1) + min;
+    return rng().next()%(max-min+1) + min;
 }
\ No newline at end of file
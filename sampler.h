@@ -0,0 +1,362 @@
+#pragma once
+
+#include "blue_noise.h"
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Dimension layout shared by every sampler, so each decision along a path always reads
+// the same dimension: the pixel jitter, lens and shutter time first, then a fixed block
+// per bounce with the light sample's two numbers followed by the BSDF's three.
+namespace sample_dimension {
+    constexpr int pixel = 0;  // 2D
+    constexpr int lens = 2;   // 2D
+    constexpr int time = 4;   // 1D
+    constexpr int bounce_base = 5;
+    constexpr int per_bounce = 5;
+
+    constexpr int light(int bounce) { return bounce_base + per_bounce * bounce; } // 2D
+    constexpr int bsdf(int bounce) { return light(bounce) + 2; } // 2D then 1D
+}
+
+class sampler {
+  public:
+    virtual ~sampler() = default;
+
+    // Begins sample `index` of pixel (i, j) at dimension 0.
+    virtual void start_pixel_sample(int i, int j, int index) {
+        pixel_i = i;
+        pixel_j = j;
+        sample_index = index;
+        dimension = 0;
+    }
+
+    // Returns to sample `index` of pixel (i, j) after other samples were drawn, for
+    // integrators that interleave many samples. Per pixel state such as a pattern is
+    // left alone, so only dimensions past the camera ray's may be read after this.
+    void resume_pixel_sample(int i, int j, int index) {
+        pixel_i = i;
+        pixel_j = j;
+        sample_index = index;
+    }
+
+    // Jumps to a dimension of the layout above.
+    void start_dimension(int d) { dimension = d; }
+
+    // Returns a number in [0,1) and advances one dimension.
+    virtual double get_1d() = 0;
+
+    // Returns a point in [0,1)^2 and advances two dimensions.
+    virtual std::pair<double, double> get_2d() = 0;
+
+  protected:
+    int pixel_i = 0, pixel_j = 0;
+    int sample_index = 0;
+    int dimension = 0;
+};
+
+class independent_sampler : public sampler {
+  // Plain random numbers; the dimension layout is irrelevant to it.
+  public:
+    double get_1d() override {
+        ++dimension;
+        return random_double();
+    }
+
+    std::pair<double, double> get_2d() override {
+        dimension += 2;
+        auto u = random_double();
+        return {u, random_double()};
+    }
+};
+
+namespace sobol_detail {
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+inline uint32_t hash(uint32_t x) {
+    // Integer finalizer (Wellons' lowbias32).
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+    return seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// Owen scrambling with a hash per tree node (Burley 2020, "Practical Hash-based Owen
+// Scrambling").
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// The first two Sobol dimensions: van der Corput, and the Pascal matrix mod 2.
+inline uint32_t sobol(uint32_t index, int dim) {
+    if (dim == 0)
+        return reverse_bits(index);
+
+    uint32_t result = 0;
+    uint32_t v = 0x80000000u;
+    for (; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            result ^= v;
+    return result;
+}
+
+inline double to_unit(uint32_t x) {
+    return x * (1.0 / 4294967296.0);
+}
+
+} // namespace sobol_detail
+
+class sobol_sampler : public sampler {
+  // Owen-scrambled Sobol points. Every 1D or 2D request is served from the first one or
+  // two Sobol dimensions, with the sample index shuffled and the point scrambled by a
+  // hash of pixel, dimension and seed. This pads to any number of dimensions while
+  // keeping each pair a well stratified (0,2)-sequence; power of two sample counts per
+  // pixel work best.
+  public:
+    explicit sobol_sampler(uint32_t seed = 0) : seed(seed) {}
+
+    double get_1d() override {
+        auto s = dimension_seed();
+        auto index = sobol_detail::nested_uniform_scramble(sample_index, s);
+        ++dimension;
+        return sobol_detail::to_unit(
+            sobol_detail::nested_uniform_scramble(sobol_detail::sobol(index, 0),
+                                                  sobol_detail::hash_combine(s, 0)));
+    }
+
+    std::pair<double, double> get_2d() override {
+        auto s = dimension_seed();
+        auto index = sobol_detail::nested_uniform_scramble(sample_index, s);
+        dimension += 2;
+        auto x = sobol_detail::nested_uniform_scramble(sobol_detail::sobol(index, 0),
+                                                       sobol_detail::hash_combine(s, 0));
+        auto y = sobol_detail::nested_uniform_scramble(sobol_detail::sobol(index, 1),
+                                                       sobol_detail::hash_combine(s, 1));
+        return {sobol_detail::to_unit(x), sobol_detail::to_unit(y)};
+    }
+
+  private:
+    uint32_t seed;
+
+    uint32_t dimension_seed() const {
+        auto h = sobol_detail::hash_combine(sobol_detail::hash(seed), uint32_t(pixel_i));
+        h = sobol_detail::hash_combine(h, uint32_t(pixel_j));
+        return sobol_detail::hash(sobol_detail::hash_combine(h, uint32_t(dimension)));
+    }
+};
+
+namespace pattern_detail {
+
+// Kensler's hash based permutation of [0, len) ("Correlated Multi-Jittered Sampling",
+// 2013). Out of range values are cycle walked by rehashing, not redrawn from the RNG.
+inline uint32_t permute(uint32_t i, uint32_t len, uint32_t p) {
+    uint32_t w = len - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p;             i *= 0xe170893du;
+        i ^= p >> 16;       i ^= (i & w) >> 4;
+        i ^= p >> 8;        i *= 0x0929eb3fu;
+        i ^= p >> 23;       i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;   i *= 0x6935fa69u;
+        i ^= (i & w) >> 11; i *= 0x74dcb303u;
+        i ^= (i & w) >> 2;  i *= 0x9e501cc3u;
+        i ^= (i & w) >> 2;  i *= 0xc860a3dfu;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= len);
+    return (i + p) % len;
+}
+
+inline double jitter(uint32_t i, uint32_t p) {
+    return sobol_detail::to_unit(sobol_detail::hash(sobol_detail::hash_combine(p, i)));
+}
+
+// Grid shape for n samples: m columns by n_rows rows with m * n_rows >= n.
+inline void grid(int n, int& m, int& n_rows) {
+    m = std::max(1, int(std::sqrt(double(n))));
+    n_rows = (n + m - 1) / m;
+}
+
+// Jittered grid with the cells visited in a shuffled order, so any prefix of the
+// pattern is spread over the square.
+inline void stratified(int n, uint32_t p, std::vector<std::pair<double, double>>& out) {
+    int m, rows;
+    grid(n, m, rows);
+    auto cells = uint32_t(m * rows);
+    for (int s = 0; s < n; ++s) {
+        auto cell = permute(uint32_t(s), cells, p);
+        out[s] = {(cell % m + jitter(s, p * 0x68bc21ebu)) / m,
+                  (cell / m + jitter(s, p * 0x02e5be93u)) / rows};
+    }
+}
+
+// One sample per row and per column of an n x n grid.
+inline void latin_hypercube(int n, uint32_t p, std::vector<std::pair<double, double>>& out) {
+    for (int s = 0; s < n; ++s)
+        out[s] = {(permute(uint32_t(s), n, p * 0xa511e9b3u) + jitter(s, p * 0xa399d265u)) / n,
+                  (permute(uint32_t(s), n, p * 0x63d83595u) + jitter(s, p * 0x711ad6a5u)) / n};
+}
+
+// Kensler's correlated multi-jittered pattern: stratified in the m x n_rows grid and
+// Latin hypercube along each axis at once.
+inline void correlated_multi_jittered(int n, uint32_t p,
+                                      std::vector<std::pair<double, double>>& out) {
+    int m, rows;
+    grid(n, m, rows);
+    for (int k = 0; k < n; ++k) {
+        // Shuffle the sample order too, or sample k would land in the same cell in every
+        // pattern and the pixel and lens points would be correlated.
+        int s = int(permute(uint32_t(k), uint32_t(m * rows), p * 0x51633e2du));
+        auto sx = permute(uint32_t(s % m), m, p * 0xa511e9b3u);
+        auto sy = permute(uint32_t(s / m), rows, p * 0x63d83595u);
+        auto jx = jitter(s, p * 0xa399d265u);
+        auto jy = jitter(s, p * 0x711ad6a5u);
+        out[k] = {(s % m + (sy + jx) / rows) / m, (s / m + (sx + jy) / m) / rows};
+    }
+}
+
+} // namespace pattern_detail
+
+class pattern_sampler : public sampler {
+  // Stratified, Latin hypercube or correlated multi-jittered points for the pixel and lens
+  // dimensions. A pixel's whole pattern is built when its first sample starts, from hashes
+  // of the pixel and dimension, so no random numbers are drawn for it. The lens pattern
+  // is a separate permutation, which decorrelates it from the pixel jitter. Samples past
+  // the pattern size and every other dimension use plain random numbers.
+  public:
+    enum class kind { stratified, latin_hypercube, correlated_multi_jittered };
+
+    pattern_sampler(kind type, int samples_per_pixel, uint32_t seed = 0)
+      : type(type), count(std::max(1, samples_per_pixel)), seed(seed),
+        pixel_points(count), lens_points(count) {}
+
+    void start_pixel_sample(int i, int j, int index) override {
+        if (!cached || i != cached_i || j != cached_j) {
+            sampler::start_pixel_sample(i, j, index);
+            generate(sample_dimension::pixel, pixel_points);
+            generate(sample_dimension::lens, lens_points);
+            cached = true;
+            cached_i = i;
+            cached_j = j;
+        }
+        sampler::start_pixel_sample(i, j, index);
+    }
+
+    double get_1d() override {
+        ++dimension;
+        return random_double();
+    }
+
+    std::pair<double, double> get_2d() override {
+        auto d = dimension;
+        dimension += 2;
+        if (sample_index < count) {
+            if (d == sample_dimension::pixel) return pixel_points[sample_index];
+            if (d == sample_dimension::lens) return lens_points[sample_index];
+        }
+        auto u = random_double();
+        return {u, random_double()};
+    }
+
+  private:
+    kind type;
+    int count;
+    uint32_t seed;
+    bool cached = false;
+    int cached_i = 0, cached_j = 0; // Pixel the points were built for
+    std::vector<std::pair<double, double>> pixel_points;
+    std::vector<std::pair<double, double>> lens_points;
+
+    void generate(int d, std::vector<std::pair<double, double>>& points) const {
+        auto p = sobol_detail::hash_combine(sobol_detail::hash(seed), uint32_t(pixel_i));
+        p = sobol_detail::hash_combine(p, uint32_t(pixel_j));
+        p = sobol_detail::hash(sobol_detail::hash_combine(p, uint32_t(d)));
+        switch (type) {
+          case kind::stratified: pattern_detail::stratified(count, p, points); break;
+          case kind::latin_hypercube: pattern_detail::latin_hypercube(count, p, points); break;
+          case kind::correlated_multi_jittered:
+            pattern_detail::correlated_multi_jittered(count, p, points);
+            break;
+        }
+    }
+};
+
+class blue_noise_sampler : public sampler {
+  // Owen-scrambled Sobol points shared by every pixel, shifted per pixel (Cranley-Patterson
+  // rotation) by a blue noise tile. Each dimension reads the tile at its own toroidal
+  // offset. Neighboring pixels thus get very different offsets, and at 1-4 samples per
+  // pixel the error appears as high frequency noise rather than clumps. More samples
+  // still converge like the Sobol sampler.
+  public:
+    explicit blue_noise_sampler(uint32_t seed = 0) : seed(seed) {}
+
+    double get_1d() override {
+        auto s = dimension_seed();
+        auto index = sobol_detail::nested_uniform_scramble(sample_index, s);
+        auto u = sobol_detail::to_unit(
+            sobol_detail::nested_uniform_scramble(sobol_detail::sobol(index, 0),
+                                                  sobol_detail::hash_combine(s, 0)));
+        u = rotate(u, dimension);
+        ++dimension;
+        return u;
+    }
+
+    std::pair<double, double> get_2d() override {
+        auto s = dimension_seed();
+        auto index = sobol_detail::nested_uniform_scramble(sample_index, s);
+        auto x = sobol_detail::nested_uniform_scramble(sobol_detail::sobol(index, 0),
+                                                       sobol_detail::hash_combine(s, 0));
+        auto y = sobol_detail::nested_uniform_scramble(sobol_detail::sobol(index, 1),
+                                                       sobol_detail::hash_combine(s, 1));
+        std::pair<double, double> u{rotate(sobol_detail::to_unit(x), dimension),
+                                    rotate(sobol_detail::to_unit(y), dimension + 1)};
+        dimension += 2;
+        return u;
+    }
+
+  private:
+    uint32_t seed;
+
+    uint32_t dimension_seed() const {
+        return sobol_detail::hash(sobol_detail::hash_combine(sobol_detail::hash(seed),
+                                                             uint32_t(dimension)));
+    }
+
+    double rotate(double u, int d) const {
+        auto h = sobol_detail::hash(sobol_detail::hash_combine(seed ^ 0x5bd1e995u, uint32_t(d)));
+        auto offset = blue_noise_tile::get()(pixel_i + int(h & 0xffff), pixel_j + int(h >> 16));
+        u += offset;
+        return u >= 1 ? u - 1 : u;
+    }
+};
@@ -3,11 +3,12 @@
 #include "hittable.h"
 #include "vec3.h"
 #include "aabb.h"
+#include "instrument.h"
 #include "material.h"
 
-class sphere : public hittable {
+class sphere final : public hittable {
 public:
-  sphere(point3 _center, double _radius, const std::shared_ptr<material> &m)
+  sphere(point3 _center, real _radius, const std::shared_ptr<material> &m)
       : center(_center), radius(_radius),
       bbox(
         interval(center.x()-radius, center.x()+radius),
@@ -16,7 +17,7 @@ public:
       mat(m) {
    }
 
-  sphere(point3 _center, double _radius, const std::shared_ptr<material> &m,
+  sphere(point3 _center, real _radius, const std::shared_ptr<material> &m,
          const vec3 &_speed)
       : center(_center), radius(_radius), speed(_speed), mat(m) {
         interval ix, iy, iz;
@@ -34,14 +35,24 @@ public:
         else iz = interval(center.z()-radius+_speed.z(), center.z()+radius);
       }
 
-  void get_sphere_uv(const point3 &p, double &u, double &v) const
+  void get_sphere_uv(const point3 &p, real &u, real &v) const
   {
-    v = acos(-p.y())/pi;
-    u = (atan2(-p.z(), p.x()) + pi)/(2*pi);
+    v = std::acos(-p.y())/real(pi);
+    u = (std::atan2(-p.z(), p.x()) + real(pi))/(2*real(pi));
   }      
 
   bool hit(const ray &r, interval ray_t,
            hit_record &rec) const override {
+    surface_hit h;
+    if (!intersect(r, ray_t, h))
+      return false;
+    complete(r, h, rec);
+    return true;
+  }
+
+  // The distance test alone; complete() builds the hit record from its result.
+  bool intersect(const ray &r, interval ray_t, surface_hit &h) const {
+    RT_COUNT(primitive_tests);
     point3 cur_center = center + r.time() * speed;
     vec3 oc = r.origin() - cur_center;
     auto a = r.direction().length_squared();
@@ -51,7 +62,7 @@ public:
     auto discriminant = half_b * half_b - a * c;
     if (discriminant < 0)
       return false;
-    auto sqrtd = sqrt(discriminant);
+    auto sqrtd = std::sqrt(discriminant);
 
     // Find the nearest root that lies in the acceptable range.
     auto root = (-half_b - sqrtd) / a;
@@ -62,16 +73,72 @@ public:
         return false;
     }
 
-    rec.t = root;
-    rec.p = r.at(rec.t);
-    vec3 outward_normal = (rec.p - cur_center) / radius;
-    rec.set_face_normal(r, outward_normal);
-    get_sphere_uv(outward_normal, rec.u, rec.v);
+    h.t = root;
+    RT_COUNT(primitive_hits);
+    return true;
+  }
 
-    rec.mat = mat;
+  bool intersect(const ray &r, interval ray_t, surface_hit &h, hit_record &) const override {
+    if (!intersect(r, ray_t, h))
+      return false;
+    h.deferred = true;
     return true;
   }
 
+  void complete(const ray &r, const surface_hit &h, hit_record &rec) const override {
+    set_hit(r, h.t, rec);
+  }
+
+  void hit_packet(const ray_packet &rays, packet_hits &hits, unsigned mask) const override {
+    real root[ray_packet::size];
+    auto found = intersect_packet(rays, hits.t, mask, root);
+    for (int k = 0; k < ray_packet::size; ++k) {
+      if (!(found >> k & 1)) continue;
+      set_hit(rays.get(k), root[k], hits.rec[k]);
+      hits.mark(k);
+    }
+  }
+
+  void intersect_packet(const ray_packet &rays, packet_hits &hits, unsigned mask) const override {
+    real root[ray_packet::size];
+    auto found = intersect_packet(rays, hits.t, mask, root);
+    for (int k = 0; k < ray_packet::size; ++k) {
+      if (!(found >> k & 1)) continue;
+      surface_hit h;
+      h.t = root[k];
+      h.deferred = true;
+      hits.defer(k, h, this);
+    }
+  }
+
+  // intersect() for every lane of mask at once, with the root choice made branch free:
+  // the lanes whose ray hits closer than t_max[lane], and their distances in t.
+  unsigned intersect_packet(const ray_packet &rays, const real *t_max, unsigned mask,
+                            real *t) const {
+    RT_COUNT_N(primitive_tests, __builtin_popcount(mask));
+    unsigned found = 0;
+    for (int k = 0; k < ray_packet::size; ++k) {
+      auto ocx = rays.ox[k] - (center.x() + rays.time[k] * speed.x());
+      auto ocy = rays.oy[k] - (center.y() + rays.time[k] * speed.y());
+      auto ocz = rays.oz[k] - (center.z() + rays.time[k] * speed.z());
+      auto a = rays.dx[k] * rays.dx[k] + rays.dy[k] * rays.dy[k] + rays.dz[k] * rays.dz[k];
+      auto half_b = ocx * rays.dx[k] + ocy * rays.dy[k] + ocz * rays.dz[k];
+      auto c = ocx * ocx + ocy * ocy + ocz * ocz - radius * radius;
+
+      auto discriminant = half_b * half_b - a * c;
+      auto sqrtd = std::sqrt(std::max(discriminant, real(0)));
+      auto near = (-half_b - sqrtd) / a;
+      auto far = (-half_b + sqrtd) / a;
+      auto root = (rays.t_min <= near && near <= t_max[k]) ? near : far;
+      t[k] = root;
+      found |= unsigned(discriminant >= 0 && rays.t_min <= root && root <= t_max[k]) << k;
+    }
+
+    found &= mask;
+    RT_COUNT_N(primitive_hits, __builtin_popcount(found));
+    return found;
+  }
+
   aabb bounding_box() const override
   {
     return bbox;
@@ -79,22 +146,70 @@ public:
 
   double pdf_value(const point3& origin, const vec3 &v) const override
   {
-    hit_record rec;
-    if(!this->hit(ray(origin, v), interval::empty, rec))
+    // The sampled cone covers the sphere exactly, so testing the direction against the
+    // cone is equivalent to intersecting the sphere.
+    auto to_center = center - origin;
+    auto distance_squared = to_center.length_squared();
+    if (distance_squared <= radius * radius)
       return 0.0;
 
-    auto cos_theta_max = sqrt(1 - radius*radius/(center-origin).length_squared());
-    auto solid_angle = 2*pi*(1-cos_theta_max);
+    auto cos_theta_max = sqrt(1 - radius*radius/distance_squared);
+    if (dot(to_center, v) < cos_theta_max * sqrt(distance_squared) * v.length())
+      return 0.0;
 
-    return 1.0/solid_angle;
+    return 1.0/solid_angle(cos_theta_max);
+  }
+
+  double hit_pdf_value(const point3& origin, const vec3 &v, const hit_record &rec) const override
+  {
+    if (rec.object != this)
+      return 0.0;
+
+    auto cos_theta_max = sqrt(1 - radius*radius/(center-origin).length_squared());
+    return 1.0/solid_angle(cos_theta_max);
   }
 
   vec3 random(const vec3 &origin) const override
+  {
+    auto u1 = random_double();
+    return random_direction(origin, u1, random_double());
+  }
+
+  bool sample(const point3 &origin, double u1, double u2, light_sample &ls) const override
+  {
+    auto to_center = center - origin;
+    auto distance_squared = to_center.length_squared();
+    if (distance_squared <= radius * radius)
+      return false;
+
+    auto dir = unit_vector(random_direction(origin, u1, u2));
+
+    // Nearest intersection of the sampled direction with the sphere, in closed form.
+    auto proj = dot(to_center, dir);
+    auto h2 = std::max(real(0), radius*radius - (distance_squared - proj*proj));
+    ls.distance = proj - std::sqrt(h2);
+    ls.p = origin + ls.distance * dir;
+    ls.normal = (ls.p - center) / radius;
+
+    auto cos_theta_max = sqrt(1 - radius*radius/distance_squared);
+    ls.pdf = 1.0/solid_angle(cos_theta_max);
+    return true;
+  }
+
+  double emitted_power() const override
+  {
+    auto area = 4 * pi * radius * radius;
+    return luminance(mat->emitted(0.5, 0.5, center)) * area;
+  }
+
+private:
+  // Direction from origin into the cone the sphere subtends, uniform in solid angle.
+  vec3 random_direction(const vec3 &origin, double u1, double u2) const
   {
     vec3 direction = center - origin;    
-    double phi = 2*pi*random_double();    
+    double phi = 2*pi*u1;    
     auto cos_theta_max = sqrt(1 - radius*radius/(center-origin).length_squared());
-    double r = random_double();
+    double r = u2;
     
     double z = 1 + r*(cos_theta_max-1); // cos_theta
     auto sin_theta = sqrt(1-z*z);
@@ -106,9 +221,21 @@ public:
     return uvw.local(x, y, z);
   }
 
-private:
+  void set_hit(const ray &r, real root, hit_record &rec) const {
+    rec.t = root;
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - (center + r.time() * speed)) / radius;
+    rec.set_face_normal(r, outward_normal);
+    get_sphere_uv(outward_normal, rec.u, rec.v);
+
+    rec.mat = mat;
+    rec.object = this;
+  }
+
+  static double solid_angle(double cos_theta_max) { return 2*pi*(1-cos_theta_max); }
+
   point3 center;
-  double radius;
+  real radius;
   vec3 speed{0, 0, 0};
   aabb bbox;
   std::shared_ptr<material> mat;
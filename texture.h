@@ -2,6 +2,7 @@
 
 #include "rtweekend.h"
 #include "color.h"
+#include "instrument.h"
 #include "rtw_image.h"
 #include "perlin.h"
 
@@ -19,6 +20,7 @@ class solid_color : public texture {
     solid_color(double red, double green, double blue) : solid_color(color(red,green,blue)) {}
 
     color value(double u, double v, const point3& p) const override {
+        RT_COUNT(texture_fetches);
         return color_value;
     }
 
@@ -58,6 +60,7 @@ class image_texture : public texture {
     image_texture(const char* filename) : image(filename) {}
 
     color value(double u, double v, const point3& p) const override {
+        RT_COUNT(texture_fetches);
         // If we have no texture data, then return solid cyan as a debugging aid.
         if (image.height() <= 0) return color(0,1,1);
 
@@ -84,6 +87,7 @@ class noise_texture : public texture {
     noise_texture(double sc) : scale(sc) {}
 
     color value(double u, double v, const point3& p) const override {
+        RT_COUNT(texture_fetches);
         auto s = scale * p;
         return color(1,1,1)*0.5*(1 + sin(s.z() + 10*noise.turb(s)));
     }
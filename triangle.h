@@ -0,0 +1,150 @@
+#pragma once
+
+#include "hittable.h"
+#include "vec3.h"
+#include "aabb.h"
+#include "instrument.h"
+#include "material.h"
+
+// Triangle with corners a, a + e1 and a + e2. The hit record's (u, v) are the
+// barycentric weights of the second and third corner.
+class triangle final : public hittable {
+  public:
+    triangle(const point3& a, const point3& b, const point3& c, std::shared_ptr<material> m)
+      : A(a), e1(b - a), e2(c - a), mat(m)
+    {
+        auto n = cross(e1, e2);
+        normal = unit_vector(n);
+        area = n.length() / 2;
+        bbox = aabb(aabb(a, b), aabb(a, c)).pad();
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        surface_hit h;
+        if (!intersect(r, ray_t, h))
+            return false;
+        complete(r, h, rec);
+        return true;
+    }
+
+    // The distance and barycentric tests alone; complete() builds the hit record from
+    // their result.
+    bool intersect(const ray& r, interval ray_t, surface_hit& h) const {
+        RT_COUNT(primitive_tests);
+        real t, u, v;
+        if (!solve(r.origin(), r.direction(), ray_t, t, u, v))
+            return false;
+
+        h.t = t;
+        h.a = u;
+        h.b = v;
+        RT_COUNT(primitive_hits);
+        return true;
+    }
+
+    bool intersect(const ray& r, interval ray_t, surface_hit& h, hit_record&) const override {
+        if (!intersect(r, ray_t, h))
+            return false;
+        h.deferred = true;
+        return true;
+    }
+
+    void complete(const ray& r, const surface_hit& h, hit_record& rec) const override {
+        rec.t = h.t;
+        rec.p = r.at(h.t);
+        rec.u = h.a;
+        rec.v = h.b;
+        rec.mat = mat;
+        rec.object = this;
+        rec.set_face_normal(r, normal);
+    }
+
+    double pdf_value(const point3& origin, const vec3 &dir) const override {
+        real t, u, v;
+        if (!solve(origin, dir, interval(0.001, infinity), t, u, v))
+            return 0;
+
+        auto distance_squared = t * t * dir.length_squared();
+        auto cosine = std::fabs(dot(dir, normal)) / dir.length();
+
+        return distance_squared / (cosine * area);
+    }
+
+    double hit_pdf_value(const point3& origin, const vec3 &dir, const hit_record &rec) const override {
+        if (rec.object != this)
+            return 0;
+
+        auto distance_squared = rec.t * rec.t * dir.length_squared();
+        auto cosine = std::fabs(dot(dir, normal) / dir.length());
+
+        return distance_squared / (cosine * area);
+    }
+
+    vec3 random(const vec3 &origin) const override {
+        return random_point(random_double(), random_double()) - origin;
+    }
+
+    bool sample(const point3 &origin, double u1, double u2, light_sample &ls) const override {
+        ls.p = random_point(u1, u2);
+        ls.normal = normal;
+
+        auto to_light = ls.p - origin;
+        auto distance_squared = to_light.length_squared();
+        ls.distance = std::sqrt(distance_squared);
+
+        auto cosine = std::fabs(dot(to_light, normal)) / ls.distance;
+        if (cosine < real(1e-8))
+            return false;
+
+        ls.pdf = distance_squared / (cosine * area);
+        return true;
+    }
+
+    double emitted_power() const override {
+        auto centroid = A + (e1 + e2) / 3;
+        return luminance(mat->emitted(1.0/3, 1.0/3, centroid)) * area;
+    }
+
+  private:
+    // Moller-Trumbore: solves origin + t dir = A + u e1 + v e2 for (t, u, v).
+    bool solve(const point3& origin, const vec3& dir, interval ray_t,
+               real& t, real& u, real& v) const {
+        // No hit if the ray is parallel to the plane, as for quads.
+        if (std::fabs(dot(normal, dir)) < real(1e-8))
+            return false;
+
+        auto pvec = cross(dir, e2);
+        auto inv_det = 1 / dot(e1, pvec);
+        auto tvec = origin - A;
+        u = dot(tvec, pvec) * inv_det;
+        if (u < 0 || 1 < u)
+            return false;
+
+        auto qvec = cross(tvec, e1);
+        v = dot(dir, qvec) * inv_det;
+        if (v < 0 || 1 < u + v)
+            return false;
+
+        t = dot(e2, qvec) * inv_det;
+        return ray_t.contains(t);
+    }
+
+    // Uniform over the triangle: a point of the parallelogram, folded back into the
+    // triangle when it lands in the other half.
+    point3 random_point(double s, double t) const {
+        if (s + t > 1) {
+            s = 1 - s;
+            t = 1 - t;
+        }
+        return A + s * e1 + t * e2;
+    }
+
+    point3 A;
+    vec3 e1, e2;
+    std::shared_ptr<material> mat;
+    aabb bbox;
+    vec3 normal;
+    real area;
+};
@@ -1,26 +1,31 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include "rtweekend.h"
 
+#ifdef RT_SIMD_VEC3
+#include "vec3_simd.h"
+#else
+
 using std::sqrt;
 using std::fabs;
 
 class vec3 {
   public:
-    double e[3];
+    real e[3];
 
     vec3() : e{0,0,0} {}
-    vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    vec3(real e0, real e1, real e2) : e{e0, e1, e2} {}
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
+    real x() const { return e[0]; }
+    real y() const { return e[1]; }
+    real z() const { return e[2]; }
 
     vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    real operator[](int i) const { return e[i]; }
+    real& operator[](int i) { return e[i]; }
 
     vec3& operator+=(const vec3 &v) {
         e[0] += v.e[0];
@@ -29,36 +34,36 @@ class vec3 {
         return *this;
     }
 
-    vec3& operator*=(double t) {
+    vec3& operator*=(real t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
         return *this;
     }
 
-    vec3& operator/=(double t) {
+    vec3& operator/=(real t) {
         return *this *= 1/t;
     }
 
-    double length() const {
-        return sqrt(length_squared());
+    real length() const {
+        return std::sqrt(length_squared());
     }
 
-    double length_squared() const {
+    real length_squared() const {
         return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
     }
 
     bool near_zero() const {
         // Return true if the vector is close to zero in all dimensions.
-        auto s = 1e-8;
-        return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
+        auto s = real(1e-8);
+        return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) && (std::fabs(e[2]) < s);
     }
 
     static vec3 random() {
         return vec3(random_double(), random_double(), random_double());
     }
 
-    static vec3 random(double min, double max) {
+    static vec3 random(real min, real max) {
         return vec3(random_double(min,max), random_double(min,max), random_double(min,max));
     }
 };
@@ -84,19 +89,19 @@ inline vec3 operator*(const vec3 &u, const vec3 &v) {
     return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3 &v) {
+inline vec3 operator*(real t, const vec3 &v) {
     return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
 }
 
-inline vec3 operator*(const vec3 &v, double t) {
+inline vec3 operator*(const vec3 &v, real t) {
     return t * v;
 }
 
-inline vec3 operator/(vec3 v, double t) {
+inline vec3 operator/(vec3 v, real t) {
     return (1/t) * v;
 }
 
-inline double dot(const vec3 &u, const vec3 &v) {
+inline real dot(const vec3 &u, const vec3 &v) {
     return u.e[0] * v.e[0]
          + u.e[1] * v.e[1]
          + u.e[2] * v.e[2];
@@ -112,12 +117,52 @@ inline vec3 unit_vector(vec3 v) {
     return v / v.length();
 }
 
-inline vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
-        if (p.length_squared() < 1)
-            return p;
+// Componentwise minimum and maximum.
+inline vec3 min(const vec3 &u, const vec3 &v) {
+    return vec3(std::min(u.e[0], v.e[0]), std::min(u.e[1], v.e[1]), std::min(u.e[2], v.e[2]));
+}
+
+inline vec3 max(const vec3 &u, const vec3 &v) {
+    return vec3(std::max(u.e[0], v.e[0]), std::max(u.e[1], v.e[1]), std::max(u.e[2], v.e[2]));
+}
+
+// Componentwise 1/v, for slab tests.
+inline vec3 reciprocal(const vec3 &v) {
+    return vec3(1/v.e[0], 1/v.e[1], 1/v.e[2]);
+}
+
+#endif // RT_SIMD_VEC3
+
+inline vec3 sample_unit_vector(real u1, real u2) {
+    // Uniform direction on the unit sphere from two uniform numbers, without rejection.
+    auto z = 1 - 2*u1;
+    auto r = std::sqrt(std::max(real(0), 1 - z*z));
+    auto phi = 2*real(pi)*u2;
+    return vec3(r*std::cos(phi), r*std::sin(phi), z);
+}
+
+inline vec3 sample_unit_disk(real u1, real u2) {
+    // Uniform point in the unit disk (z = 0) from two uniform numbers, using Shirley and
+    // Chiu's concentric mapping, which keeps the stratification of the input square.
+    auto a = 2*u1 - 1;
+    auto b = 2*u2 - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+
+    real r, phi;
+    if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        phi = (real(pi)/4) * (b/a);
+    } else {
+        r = b;
+        phi = (real(pi)/2) - (real(pi)/4) * (a/b);
     }
+    return vec3(r*std::cos(phi), r*std::sin(phi), 0);
+}
+
+inline vec3 random_in_unit_disk() {
+    auto u1 = random_double();
+    return sample_unit_disk(u1, random_double());
 }
 
 inline vec3 random_in_unit_sphere() {
@@ -144,9 +189,9 @@ inline vec3 reflect(const vec3& v, const vec3& n) {
     return v - 2*dot(v,n)*n;
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
-    auto cos_theta = fmin(dot(-uv, n), 1.0);
+inline vec3 refract(const vec3& uv, const vec3& n, real etai_over_etat) {
+    auto cos_theta = std::min(dot(-uv, n), real(1));
     vec3 r_out_perp =  etai_over_etat * (uv + cos_theta*n);
-    vec3 r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.length_squared())) * n;
+    vec3 r_out_parallel = -std::sqrt(std::fabs(1 - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
\ No newline at end of file
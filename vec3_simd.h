@@ -0,0 +1,196 @@
+#pragma once
+
+// vec3 held in one SIMD register: four floats in an SSE register when real is float,
+// four doubles in an AVX register otherwise. The fourth lane is padding and every
+// operation keeps it at zero, so horizontal sums can include it. Included by vec3.h
+// when RT_SIMD_VEC3 is defined; the interface is the same as the scalar vec3.
+
+#include <cmath>
+#include <immintrin.h>
+#include <iostream>
+#include "rtweekend.h"
+
+#ifdef RT_USE_FLOAT
+#if !defined(__SSE4_1__)
+#error "RT_SIMD_VEC3 with RT_USE_FLOAT needs SSE4.1"
+#endif
+#else
+#if !defined(__AVX2__)
+#error "RT_SIMD_VEC3 with double precision needs AVX2"
+#endif
+#endif
+
+using std::sqrt;
+using std::fabs;
+
+namespace simd {
+
+#ifdef RT_USE_FLOAT
+using reg = __m128;
+
+inline reg zero() { return _mm_setzero_ps(); }
+inline reg set(real x, real y, real z) { return _mm_set_ps(0, z, y, x); }
+inline reg broadcast(real t) { return _mm_set1_ps(t); }
+inline reg add(reg a, reg b) { return _mm_add_ps(a, b); }
+inline reg sub(reg a, reg b) { return _mm_sub_ps(a, b); }
+inline reg mul(reg a, reg b) { return _mm_mul_ps(a, b); }
+inline reg div(reg a, reg b) { return _mm_div_ps(a, b); }
+inline reg min(reg a, reg b) { return _mm_min_ps(a, b); }
+inline reg max(reg a, reg b) { return _mm_max_ps(a, b); }
+inline reg neg(reg a) { return _mm_xor_ps(_mm_set1_ps(-0.0f), a); }
+inline reg abs(reg a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+inline reg keep_xyz(reg a) { return _mm_blend_ps(a, _mm_setzero_ps(), 0x8); }
+inline reg yzx(reg a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)); }
+inline int less_mask(reg a, reg b) { return _mm_movemask_ps(_mm_cmplt_ps(a, b)); }
+
+// x*x' + y*y' + z*z', by shuffles rather than dpps, which is slower on most cores.
+inline real dot(reg a, reg b) {
+    auto p = _mm_mul_ps(a, b);
+    auto s = _mm_add_ps(p, _mm_movehl_ps(p, p));                  // (x+z, y+w, ...)
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1))); // x+z+y+w
+}
+#else
+using reg = __m256d;
+
+inline reg zero() { return _mm256_setzero_pd(); }
+inline reg set(real x, real y, real z) { return _mm256_set_pd(0, z, y, x); }
+inline reg broadcast(real t) { return _mm256_set1_pd(t); }
+inline reg add(reg a, reg b) { return _mm256_add_pd(a, b); }
+inline reg sub(reg a, reg b) { return _mm256_sub_pd(a, b); }
+inline reg mul(reg a, reg b) { return _mm256_mul_pd(a, b); }
+inline reg div(reg a, reg b) { return _mm256_div_pd(a, b); }
+inline reg min(reg a, reg b) { return _mm256_min_pd(a, b); }
+inline reg max(reg a, reg b) { return _mm256_max_pd(a, b); }
+inline reg neg(reg a) { return _mm256_xor_pd(_mm256_set1_pd(-0.0), a); }
+inline reg abs(reg a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+inline reg keep_xyz(reg a) { return _mm256_blend_pd(a, _mm256_setzero_pd(), 0x8); }
+inline reg yzx(reg a) { return _mm256_permute4x64_pd(a, _MM_SHUFFLE(3, 0, 2, 1)); }
+inline int less_mask(reg a, reg b) { return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ)); }
+
+// x*x' + y*y' + z*z' (the padding lane adds zero).
+inline real dot(reg a, reg b) {
+    auto p = _mm256_mul_pd(a, b);
+    auto s = _mm_add_pd(_mm256_castpd256_pd128(p), _mm256_extractf128_pd(p, 1)); // (x+z, y+w)
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));                  // x+z+y+w
+}
+#endif
+
+} // namespace simd
+
+class vec3 {
+  public:
+    union {
+        simd::reg m;
+        real e[4];
+    };
+
+    vec3() : m(simd::zero()) {}
+    vec3(real e0, real e1, real e2) : m(simd::set(e0, e1, e2)) {}
+    explicit vec3(simd::reg r) : m(r) {}
+
+    real x() const { return e[0]; }
+    real y() const { return e[1]; }
+    real z() const { return e[2]; }
+
+    vec3 operator-() const { return vec3(simd::keep_xyz(simd::neg(m))); }
+    real operator[](int i) const { return e[i]; }
+    real& operator[](int i) { return e[i]; }
+
+    vec3& operator+=(const vec3 &v) {
+        m = simd::add(m, v.m);
+        return *this;
+    }
+
+    vec3& operator*=(real t) {
+        m = simd::mul(m, simd::broadcast(t));
+        return *this;
+    }
+
+    vec3& operator/=(real t) {
+        return *this *= 1/t;
+    }
+
+    real length() const {
+        return std::sqrt(length_squared());
+    }
+
+    real length_squared() const {
+        return simd::dot(m, m);
+    }
+
+    bool near_zero() const {
+        // Return true if the vector is close to zero in all dimensions.
+        return (simd::less_mask(simd::abs(m), simd::broadcast(real(1e-8))) & 0x7) == 0x7;
+    }
+
+    static vec3 random() {
+        return vec3(random_double(), random_double(), random_double());
+    }
+
+    static vec3 random(real min, real max) {
+        return vec3(random_double(min,max), random_double(min,max), random_double(min,max));
+    }
+};
+
+// point3 is just an alias for vec3, but useful for geometric clarity in the code.
+using point3 = vec3;
+
+// Vector Utility Functions
+
+inline std::ostream& operator<<(std::ostream &out, const vec3 &v) {
+    return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
+}
+
+inline vec3 operator+(const vec3 &u, const vec3 &v) {
+    return vec3(simd::add(u.m, v.m));
+}
+
+inline vec3 operator-(const vec3 &u, const vec3 &v) {
+    return vec3(simd::sub(u.m, v.m));
+}
+
+inline vec3 operator*(const vec3 &u, const vec3 &v) {
+    return vec3(simd::mul(u.m, v.m));
+}
+
+inline vec3 operator*(real t, const vec3 &v) {
+    return vec3(simd::mul(simd::broadcast(t), v.m));
+}
+
+inline vec3 operator*(const vec3 &v, real t) {
+    return t * v;
+}
+
+inline vec3 operator/(vec3 v, real t) {
+    return (1/t) * v;
+}
+
+inline real dot(const vec3 &u, const vec3 &v) {
+    return simd::dot(u.m, v.m);
+}
+
+inline vec3 cross(const vec3 &u, const vec3 &v) {
+    // (u * v.yzx - u.yzx * v).yzx; the padding lane stays 0*0 - 0*0.
+    auto c = simd::sub(simd::mul(u.m, simd::yzx(v.m)), simd::mul(simd::yzx(u.m), v.m));
+    return vec3(simd::yzx(c));
+}
+
+inline vec3 unit_vector(vec3 v) {
+    // One scalar square root and divide, then a broadcast multiply: cheaper than a
+    // full width sqrt and divide, and rounds the same as the scalar vec3.
+    return v * (1 / std::sqrt(simd::dot(v.m, v.m)));
+}
+
+// Componentwise minimum and maximum.
+inline vec3 min(const vec3 &u, const vec3 &v) {
+    return vec3(simd::min(u.m, v.m));
+}
+
+inline vec3 max(const vec3 &u, const vec3 &v) {
+    return vec3(simd::max(u.m, v.m));
+}
+
+// Componentwise 1/v, for slab tests.
+inline vec3 reciprocal(const vec3 &v) {
+    return vec3(simd::keep_xyz(simd::div(simd::broadcast(1), v.m)));
+}
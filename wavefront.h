@@ -0,0 +1,89 @@
+#pragma once
+
+#include "color.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "material.h"
+#include "ray.h"
+
+#include <cstdint>
+#include <vector>
+
+// Path state for the wavefront integrator, one array per field. A path keeps its slot
+// for its whole life; the stages run over queues of slots, and the sorts between stages
+// reorder those queues rather than the state itself.
+class path_buffer {
+  public:
+    // Current ray of each path.
+    std::vector<real> ox, oy, oz;
+    std::vector<real> dx, dy, dz;
+    std::vector<real> time;
+
+    // Product of the attenuations so far, and the radiance gathered so far.
+    std::vector<color> throughput;
+    std::vector<color> radiance;
+
+    // Density the current ray was sampled with, for weighting the emission it finds
+    // against light sampling; 0 for camera rays and after materials without one.
+    std::vector<double> pdf;
+
+    // Pixel and sample index, for the sampler and the framebuffer.
+    std::vector<int> pixel_i, pixel_j, sample;
+
+    // Closest hit of the current ray, written by the intersect stage, and its shading
+    // bin: 0 for a miss, 1 + the hit material's type otherwise.
+    std::vector<hit_record> rec;
+    std::vector<uint8_t> bin;
+
+    static constexpr int bins = material_type_count + 1;
+
+    std::vector<aov_sample> aov; // Primary hit data, when the framebuffer has AOVs
+
+    void resize(size_t n, bool aovs) {
+        for (auto v : {&ox, &oy, &oz, &dx, &dy, &dz, &time})
+            v->resize(n);
+        throughput.resize(n);
+        radiance.resize(n);
+        pdf.resize(n);
+        pixel_i.resize(n);
+        pixel_j.resize(n);
+        sample.resize(n);
+        rec.resize(n);
+        bin.resize(n);
+        aov.resize(aovs ? n : 0);
+    }
+
+    ray get_ray(uint32_t k) const {
+        return ray(point3(ox[k], oy[k], oz[k]), vec3(dx[k], dy[k], dz[k]), time[k]);
+    }
+
+    void set_hit(uint32_t k, bool hit) {
+        bin[k] = hit ? uint8_t(1 + int(rec[k].mat->type)) : 0;
+    }
+
+    void set_ray(uint32_t k, const ray& r) {
+        auto o = r.origin(), d = r.direction();
+        ox[k] = o.x(); oy[k] = o.y(); oz[k] = o.z();
+        dx[k] = d.x(); dy[k] = d.y(); dz[k] = d.z();
+        time[k] = r.time();
+    }
+
+    // Octant of the ray direction, 0..7: rays sorted by it traverse the BVH in similar
+    // order, and consecutive ones can share a ray_packet.
+    int octant(uint32_t k) const { return (dx[k] < 0) | (dy[k] < 0) << 1 | (dz[k] < 0) << 2; }
+};
+
+// Stable counting sort of queue by key(slot), which must lie in [0, buckets).
+template <typename Key>
+void sort_queue(std::vector<uint32_t>& queue, std::vector<uint32_t>& scratch, int buckets,
+                Key key) {
+    std::vector<uint32_t> starts(buckets + 1, 0);
+    for (auto k : queue)
+        ++starts[key(k) + 1];
+    for (int b = 0; b < buckets; ++b)
+        starts[b + 1] += starts[b];
+    scratch.resize(queue.size());
+    for (auto k : queue)
+        scratch[starts[key(k)]++] = k;
+    queue.swap(scratch);
+}